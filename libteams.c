@@ -41,6 +41,10 @@ teams_do_all_the_things(TeamsAccount *sa)
 		teams_check_authrequests(sa);
 		sa->authcheck_timeout = g_timeout_add_seconds(120, (GSourceFunc)teams_check_authrequests, sa);
 		purple_connection_set_state(sa->pc, PURPLE_CONNECTION_CONNECTED);
+		if (sa->login_started) {
+			purple_debug_info("teams", "Connected in %" G_GINT64_FORMAT " ms\n", (g_get_monotonic_time() - sa->login_started) / 1000);
+			sa->login_started = 0;
+		}
 
 		teams_get_friend_list(sa);
 		//TODO remove me when switching to websocket
@@ -309,6 +313,8 @@ teams_buddy_free(PurpleBuddy *buddy)
 	{
 		purple_buddy_set_protocol_data(buddy, NULL);
 
+		teams_icon_queue_cancel(sbuddy->sa, purple_buddy_get_name(buddy));
+
 		g_free(sbuddy->skypename);
 		g_free(sbuddy->fullname);
 		g_free(sbuddy->display_name);
@@ -392,7 +398,20 @@ teams_login(PurpleAccount *account)
 	sa->messages_host = g_strdup(TEAMS_DEFAULT_MESSAGES_HOST);
 	sa->keepalive_pool = purple_http_keepalive_pool_new();
 	purple_http_keepalive_pool_set_limit_per_host(sa->keepalive_pool, TEAMS_MAX_CONNECTIONS);
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	// avatars and file transfer status polls are small idempotent GETs; streamed responses are never pipelined
+	purple_http_keepalive_pool_set_pipelining(sa->keepalive_pool, TEAMS_BASE_ORIGIN_HOST, TEAMS_PIPELINE_DEPTH);
+	purple_http_keepalive_pool_set_pipelining(sa->keepalive_pool, TEAMS_XFER_HOST, TEAMS_PIPELINE_DEPTH);
+#endif
+	// one poll at a time per host, reusing its socket from one cycle to the next
+	sa->longpoll_pool = purple_http_keepalive_pool_new();
+	purple_http_keepalive_pool_set_limit_per_host(sa->longpoll_pool, 1);
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	purple_http_keepalive_pool_set_idle_timeout(sa->longpoll_pool, TEAMS_LONGPOLL_IDLE_SECONDS);
+#endif
 	sa->conns = purple_http_connection_set_new();
+	teams_icon_queue_init(sa);
+	teams_event_index_init(sa);
 	
 #ifdef ENABLE_TEAMS_PERSONAL
 	tenant = TEAMS_PERSONAL_TENANT_ID;
@@ -403,10 +422,13 @@ teams_login(PurpleAccount *account)
 		sa->tenant = g_strdup(tenant);
 	}
 	
+	sa->login_started = g_get_monotonic_time();
+	
 	if (password && *password) {
 		sa->refresh_token = g_strdup(password);
 		purple_connection_update_progress(pc, _("Authenticating"), 1, 3);
 		teams_oauth_refresh_token(sa);
+		teams_prewarm_connections(sa);
 	} else {
 		teams_do_devicecode_login(sa);
 	}
@@ -446,15 +468,38 @@ teams_close(PurpleConnection *pc)
 
 	teams_logout(sa);
 	
+	teams_icon_queue_destroy(sa);
+	teams_event_index_destroy(sa);
+	teams_host_profiles_invalidate(sa);
+	
 	purple_debug_info("teams", "destroying incomplete connections\n");
 
 	purple_http_connection_set_destroy(sa->conns);
 	sa->conns = NULL;
 	purple_http_conn_cancel_all(pc);
+	teams_post_or_get_cancel_deferred(sa);
+	if (sa->host_throttle != NULL) {
+		g_hash_table_destroy(sa->host_throttle);
+		sa->host_throttle = NULL;
+	}
+	if (sa->host_buckets != NULL) {
+		g_hash_table_destroy(sa->host_buckets);
+		sa->host_buckets = NULL;
+	}
+	if (sa->inflight_requests != NULL) {
+		// Emptied by the callbacks of the cancelled connections
+		g_hash_table_destroy(sa->inflight_requests);
+		sa->inflight_requests = NULL;
+	}
+	if (sa->validators != NULL) {
+		g_hash_table_destroy(sa->validators);
+		sa->validators = NULL;
+	}
 	purple_http_keepalive_pool_unref(sa->keepalive_pool);
+	purple_http_keepalive_pool_unref(sa->longpoll_pool);
 	purple_http_cookie_jar_unref(sa->cookie_jar);
 
-	teams_trouter_stop(sa);
+	teams_trouter_free(sa);
 
 	buddies = purple_blist_find_buddies(sa->account, NULL);
 	while (buddies != NULL) {
@@ -859,6 +904,15 @@ teams_protocol_init(PurpleProtocol *prpl_info)
 	
 	opt = purple_account_option_int_new(_("Notify me before meeting begins (minutes)"), "calendar_notify_minutes", -1);
 	TEAMS_PRPL_APPEND_ACCOUNT_OPTION(opt);
+	
+	opt = purple_account_option_int_new(_("Maximum simultaneous buddy icon downloads"), "icon_download_concurrency", TEAMS_DEFAULT_ICON_DOWNLOADS);
+	TEAMS_PRPL_APPEND_ACCOUNT_OPTION(opt);
+	
+	opt = purple_account_option_int_new(_("Maximum requests per second to each server (0 for no limit)"), "rate_limit_per_second", TEAMS_DEFAULT_RATE_LIMIT);
+	TEAMS_PRPL_APPEND_ACCOUNT_OPTION(opt);
+	
+	opt = purple_account_option_int_new(_("Requests allowed in a burst to each server"), "rate_limit_burst", TEAMS_DEFAULT_RATE_BURST);
+	TEAMS_PRPL_APPEND_ACCOUNT_OPTION(opt);
 
 #undef TEAMS_PRPL_APPEND_ACCOUNT_OPTION
 	
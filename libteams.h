@@ -25,6 +25,8 @@
 
 /* Maximum number of simultaneous connections to a server */
 #define TEAMS_MAX_CONNECTIONS 16
+/* Maximum number of pipelined GETs in flight on one of those */
+#define TEAMS_PIPELINE_DEPTH 4
 
 #include <glib.h>
 
@@ -113,7 +115,23 @@
 #endif
 
 #define TEAMS_CALENDAR_REFRESH_MINUTES 15
+#define TEAMS_DEFAULT_ICON_DOWNLOADS 4
+#define TEAMS_EVENT_INDEX_SIZE 512
+#define TEAMS_EVENT_INDEX_WINDOW_SECONDS (30 * 60)
+#define TEAMS_POLL_MAX_BACKOFF_SECONDS 8
+#define TEAMS_POLL_TROUTER_INTERVAL_SECONDS 120
+#define TEAMS_POLL_WATCHDOG_SECONDS 60
+#define TEAMS_LONGPOLL_IDLE_SECONDS 60
+#define TEAMS_TROUTER_HEALTHY_SECONDS 90
+#define TEAMS_TROUTER_MAX_BACKOFF_SECONDS 300
+#define TEAMS_TROUTER_REGISTRATION_TTL 86400
+#define TEAMS_TROUTER_REREGISTER_MARGIN 3600
 #define TEAMS_MAX_MSG_RETRY 2
+#define TEAMS_RETRY_BASE_SECONDS 1
+#define TEAMS_RETRY_MAX_SECONDS 60
+#define TEAMS_RETRY_AFTER_MAX_SECONDS 300
+#define TEAMS_DEFAULT_RATE_LIMIT 8
+#define TEAMS_DEFAULT_RATE_BURST 16
 
 #define TEAMS_PLUGIN_ID "prpl-eionrobb-msteams"
 #define TEAMS_PLUGIN_VERSION "1.0"
@@ -176,6 +194,7 @@ struct _TeamsAccount {
 	PurpleAccount *account;
 	PurpleConnection *pc;
 	PurpleHttpKeepalivePool *keepalive_pool;
+	PurpleHttpKeepalivePool *longpoll_pool; // TEAMS_METHOD_LONGPOLL, kept off keepalive_pool
 	PurpleHttpConnectionSet *conns;
 	PurpleHttpCookieJar *cookie_jar;
 	gchar *messages_host;
@@ -213,9 +232,53 @@ struct _TeamsAccount {
 	GHashTable *calendar_reminder_timeouts;
 	guint calendar_poll_timeout;
 	
+	//buddy icon downloads
+	GQueue *icon_queue;
+	GHashTable *icon_queued;
+	guint icon_downloads_active;
+	guint icon_downloads_max;
+	
+	//last time an unchanged friend list refresh resubscribed statuses
+	gint64 friend_list_unchanged_at;
+	
+	//monotonic time teams_login() started, cleared once connected
+	gint64 login_started;
+	
+	//long-poll scheduling
+	gint64 poll_started;
+	guint poll_events;
+	guint poll_backoff;
+	
+	//pre-built request headers per host, see teams_connection.c
+	GHashTable *host_profiles;
+	
+	//requests that identical ones can piggyback on, see teams_connection.c
+	GHashTable *inflight_requests;
+	//ETag/Last-Modified of TEAMS_METHOD_CONDITIONAL responses
+	GHashTable *validators;
+	//host -> time until which it asked us to back off (429/503)
+	GHashTable *host_throttle;
+	//requests waiting on a retry or throttle timer
+	GHashTable *deferred_requests;
+	//host -> outbound token bucket, see teams_connection.c
+	GHashTable *host_buckets;
+	
+	//events already seen via long-poll or trouter
+	struct _TeamsEventIndex *event_index;
+	
 	struct _PurpleWebsocket *trouter_socket;
 	gchar *trouter_surl;
 	guint trouter_ping_timeout;
+	gint64 trouter_last_activity;
+	JsonObject *trouter_info;
+	gint64 trouter_info_expiry;
+	gchar *trouter_registered_surl;
+	gint64 trouter_registered_at;
+	gchar *trouter_registering_surl;
+	GSList *trouter_registrations;
+	guint trouter_reconnect_timeout;
+	guint trouter_reconnect_attempts;
+	struct _TeamsTrouterDecoder *trouter_decoder;
 	guint trouter_command_count;
 
 	//devicecode login
@@ -1,7 +1,13 @@
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -26,7 +32,9 @@ static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 #define WS_OP_PING 0x09
 #define WS_OP_PONG 0x0A
 #define WS_MASK	0x80
-#define MAX_FRAG 64
+#define MAX_MESSAGE (16 * 1024 * 1024)
+/* don't bother compressing outgoing messages smaller than this */
+#define WS_DEFLATE_MIN 64
 
 struct buffer {
 	guchar *buf;
@@ -46,11 +54,24 @@ struct _PurpleWebsocket {
 
 	int fd;
 	guint inpa;
+	PurpleInputCondition inpa_cond;
 
 	struct buffer input, output;
+	gsize input_start; /* start of unparsed data in input */
+	struct buffer message; /* reassembly of fragmented messages */
+	uint8_t message_header; /* first frame header of the message being reassembled */
 
 	gboolean connected;
 	PurpleInputCondition closed;
+
+	/* permessage-deflate (RFC 7692) */
+	gboolean deflate;
+	gboolean inflate_reset, deflate_reset; /* *_no_context_takeover */
+	int deflate_bits; /* 0 to send uncompressed */
+	z_stream inflater, deflater;
+	gboolean deflater_ready;
+	struct buffer inflated, deflated;
+	guint64 wire_in, data_in, wire_out, data_out;
 };
 
 static void buffer_set_len(struct buffer *b, size_t n) {
@@ -67,6 +88,14 @@ static inline guchar *buffer_incr(struct buffer *b, size_t n) {
 	return &b->buf[l];
 }
 
+/* make sure there's at least n bytes free past len, growing geometrically */
+static void buffer_reserve(struct buffer *b, size_t n) {
+	if (b->len + n > b->siz) {
+		b->siz = MAX(b->siz * 2, b->len + n);
+		b->buf = g_realloc(b->buf, b->siz);
+	}
+}
+
 void purple_websocket_abort(PurpleWebsocket *ws) {
 	if (ws == NULL)
 		return;
@@ -84,9 +113,20 @@ void purple_websocket_abort(PurpleWebsocket *ws) {
 	if (ws->fd >= 0)
 		close(ws->fd);
 
+	if (ws->deflate) {
+		purple_debug_misc("websocket", "deflate: received %" G_GUINT64_FORMAT " bytes as %" G_GUINT64_FORMAT ", sent %" G_GUINT64_FORMAT " bytes as %" G_GUINT64_FORMAT "\n",
+				ws->data_in, ws->wire_in, ws->data_out, ws->wire_out);
+		inflateEnd(&ws->inflater);
+		if (ws->deflater_ready)
+			deflateEnd(&ws->deflater);
+	}
+
 	g_free(ws->key);
 	g_free(ws->output.buf);
 	g_free(ws->input.buf);
+	g_free(ws->message.buf);
+	g_free(ws->inflated.buf);
+	g_free(ws->deflated.buf);
 
 	g_free(ws);
 }
@@ -131,6 +171,122 @@ static const char *find_header_content(const char *data, const char *name) {
 	return NULL;
 }
 
+static gboolean ws_read_extensions(PurpleWebsocket *ws, const char *ext) {
+	const char *eol;
+	gchar *value, **params, **param;
+
+	if (!(ext = skip_lws(ext)))
+		return TRUE;
+
+	eol = strstr(ext, "\r\n");
+	value = eol ? g_strndup(ext, eol - ext) : g_strdup(ext);
+	params = g_strsplit(value, ";", -1);
+	g_free(value);
+
+	if (!params[0] || strcmp(g_strstrip(params[0]), "permessage-deflate") != 0) {
+		g_strfreev(params);
+		ws_error(ws, "Unsupported extension");
+		return FALSE;
+	}
+
+	ws->deflate_bits = MAX_WBITS;
+	for (param = &params[1]; *param; param++) {
+		gchar *p = g_strstrip(*param);
+		if (!strcmp(p, "server_no_context_takeover"))
+			ws->inflate_reset = TRUE;
+		else if (!strcmp(p, "client_no_context_takeover"))
+			ws->deflate_reset = TRUE;
+		else if (!strncmp(p, "client_max_window_bits=", 23)) {
+			int bits = atoi(p + 23);
+			/* zlib can't produce raw deflate with an 8 bit window, so just don't compress */
+			ws->deflate_bits = bits >= 9 && bits <= MAX_WBITS ? bits : 0;
+		}
+		/* server_max_window_bits: inflating with the full window handles anything smaller */
+	}
+	g_strfreev(params);
+
+	if (inflateInit2(&ws->inflater, -MAX_WBITS) != Z_OK) {
+		ws_error(ws, "Unable to initialise inflate");
+		return FALSE;
+	}
+	ws->deflate = TRUE;
+	purple_debug_misc("websocket", "permessage-deflate enabled\n");
+	return TRUE;
+}
+
+static gboolean ws_inflate(PurpleWebsocket *ws, const guchar *in, size_t len) {
+	static const guchar tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	struct buffer *b = &ws->inflated;
+	z_stream *z = &ws->inflater;
+	int pass, r;
+
+	b->len = 0;
+	/* the sender strips the trailing empty block, so feed it back in after the payload */
+	for (pass = 0, r = Z_OK; pass < 2 && r != Z_STREAM_END; pass++) {
+		z->next_in = (Bytef *)(pass ? tail : in);
+		z->avail_in = pass ? sizeof(tail) : len;
+		do {
+			buffer_reserve(b, MAX(len, 1024));
+			z->next_out = b->buf + b->len;
+			/* one byte over the limit is enough to know it's too big */
+			z->avail_out = MIN(b->siz - b->len, MAX_MESSAGE + 1 - b->len);
+			r = inflate(z, Z_SYNC_FLUSH);
+			b->len = z->next_out - b->buf;
+			if (b->len > MAX_MESSAGE) {
+				ws_error(ws, "Maximum message size exceeded");
+				return FALSE;
+			}
+			if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+				ws_error(ws, "Invalid compressed message");
+				return FALSE;
+			}
+		} while (r == Z_OK && (z->avail_in > 0 || z->avail_out == 0));
+	}
+
+	/* a final block ends the stream, so the next message starts afresh either way */
+	if (ws->inflate_reset || r == Z_STREAM_END)
+		inflateReset(z);
+
+	ws->wire_in += len;
+	ws->data_in += b->len;
+	return TRUE;
+}
+
+static gboolean ws_deflate(PurpleWebsocket *ws, const guchar *in, size_t len) {
+	struct buffer *b = &ws->deflated;
+	z_stream *z = &ws->deflater;
+
+	if (!ws->deflater_ready) {
+		if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ws->deflate_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			ws->deflate_bits = 0;
+			return FALSE;
+		}
+		ws->deflater_ready = TRUE;
+	}
+
+	b->len = 0;
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	do {
+		buffer_reserve(b, deflateBound(z, len) + 8);
+		z->next_out = b->buf + b->len;
+		z->avail_out = b->siz - b->len;
+		deflate(z, Z_SYNC_FLUSH);
+		b->len = z->next_out - b->buf;
+	} while (z->avail_in > 0 || z->avail_out == 0);
+
+	/* strip the 00 00 ff ff the sync flush ends with */
+	if (b->len >= 4)
+		b->len -= 4;
+
+	if (ws->deflate_reset)
+		deflateReset(z);
+
+	ws->data_out += len;
+	ws->wire_out += b->len;
+	return TRUE;
+}
+
 static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 	const char *upgrade = skip_lws(find_header_content(headers, "Upgrade"));
 	if (upgrade && (g_ascii_strncasecmp(upgrade, "websocket", 9) != 0 || skip_lws(upgrade+9)))
@@ -159,29 +315,65 @@ static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 		g_free(b);
 	}
 
-	/* TODO: Sec-WebSocket-Extensions, Sec-WebSocket-Protocol */
+	/* TODO: Sec-WebSocket-Protocol */
 
 	if (strncmp(headers, "HTTP/1.1 101 ", 13) != 0 || !upgrade || !connection || !accept) {
 		ws_error(ws, headers);
 		return FALSE;
 	}
 
+	if (!ws_read_extensions(ws, find_header_content(headers, "Sec-WebSocket-Extensions")))
+		return FALSE;
+
 	ws->connected = TRUE;
 	ws->callback(ws, ws->user_data, PURPLE_WEBSOCKET_OPEN, NULL, 0);
 	return TRUE;
 }
 
+/* hand a complete message to the callback; FALSE if the websocket is gone */
+static gboolean ws_deliver(PurpleWebsocket *ws, uint8_t header, guchar *p, size_t l) {
+	if (header & WS_RSV1) {
+		if (!ws_inflate(ws, p, l))
+			return FALSE;
+		purple_debug_misc("websocket", "message %x len %lu (%lu compressed)\n", header, (unsigned long) ws->inflated.len, (unsigned long) l);
+		p = ws->inflated.buf;
+		l = ws->inflated.len;
+	} else
+		purple_debug_misc("websocket", "message %x len %lu\n", header, (unsigned long) l);
+
+	uint8_t op = header & WS_OP_MASK;
+	switch (op) {
+		case WS_OP_TEXT:
+		case WS_OP_BIN:
+		case WS_OP_PONG:
+		case WS_OP_CLOS:
+			ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, p, l);
+			if (op == WS_OP_CLOS) {
+				ws->closed |= PURPLE_INPUT_READ;
+				if (ws->closed & PURPLE_INPUT_WRITE) {
+					purple_websocket_abort(ws);
+					return FALSE;
+				} else
+					purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
+			}
+			break;
+		case WS_OP_PING:
+			purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, p, l);
+			break;
+		default:
+			ws_error(ws, "Unknown frame op");
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Parse one frame at the read position.  Returns the number of bytes it
+ * used, more than are available if it needs more, or 0 on error. */
 static size_t ws_read_message(PurpleWebsocket *ws) {
-	uint8_t *input = ws->input.buf;
-	size_t len = ws->input.off;
+	uint8_t *input = ws->input.buf + ws->input_start;
+	size_t len = ws->input.off - ws->input_start;
 	size_t off = 0;
-	struct {
-		guchar *p;
-		size_t l;
-	} frag[MAX_FRAG];
-	unsigned fi;
 
-	for (fi = 0; fi < MAX_FRAG; fi ++) {
 #define GETN(N) ({ \
 		if (len-off < (N)) \
 			return off+N; \
@@ -192,87 +384,88 @@ static size_t ws_read_message(PurpleWebsocket *ws) {
 #define GETB(T) (*(uint8_t*)GETN(1))
 #define GET(V) memcpy(&(V), GETN(sizeof(V)), sizeof(V))
 
-		if (len-off < 2)
-			return off+2;
-		uint8_t header = GETB(uint8_t);
-		if (header & ~(WS_OP_MASK|WS_FIN)) {
-			ws_error(ws, "Unsupported RSV flag");
-			return 0;
-		}
-		uint8_t mlen = GETB(uint8_t);
-		if (mlen & WS_MASK) {
-			ws_error(ws, "Masked frame");
-			return 0;
-		}
-		uint64_t plen = mlen & ~WS_MASK;
-		uint16_t tlen;
-		switch (plen) {
-			case 127:
-				GET(plen);
-				plen = GUINT64_FROM_BE(plen);
-				break;
-			case 126:
-				GET(tlen);
-				plen = GUINT16_FROM_BE(tlen);
-				break;
-		}
-		frag[fi].l = plen;
-		frag[fi].p = GETN(plen);
-	
+	if (len-off < 2)
+		return off+2;
+	uint8_t header = GETB(uint8_t);
+	uint8_t op = header & WS_OP_MASK;
+	/* RSV1 marks a compressed message, only valid on the first frame of a data message */
+	if (header & (WS_RSV2|WS_RSV3) ||
+			(header & WS_RSV1 && (!ws->deflate || op == WS_OP_CONT || op & WS_OP_CLOS))) {
+		ws_error(ws, "Unsupported RSV flag");
+		return 0;
+	}
+	uint8_t mlen = GETB(uint8_t);
+	if (mlen & WS_MASK) {
+		ws_error(ws, "Masked frame");
+		return 0;
+	}
+	uint64_t plen = mlen & ~WS_MASK;
+	uint16_t tlen;
+	switch (plen) {
+		case 127:
+			GET(plen);
+			plen = GUINT64_FROM_BE(plen);
+			break;
+		case 126:
+			GET(tlen);
+			plen = GUINT16_FROM_BE(tlen);
+			break;
+	}
+	/* the limit is on the whole message, however many fragments it comes in */
+	if (plen > MAX_MESSAGE - ws->message.len) {
+		ws_error(ws, "Maximum message size exceeded");
+		return 0;
+	}
+	guchar *payload = GETN(plen);
+
 #undef GET
 #undef GETB
 #undef GETN
 
-		if (header & WS_FIN) {
-			/* consolidate all the fragments after the first */
-			unsigned i;
-			for (i = 1; i <= fi; i++) {
-				memmove(&frag[0].p[frag[0].l], frag[i].p, frag[i].l);
-				frag[0].l += frag[i].l;
-			}
+	if (op & WS_OP_CLOS) {
+		/* control frames can arrive in the middle of a fragmented message */
+		return ws_deliver(ws, header, payload, plen) ? off : 0;
+	}
 
-			purple_debug_misc("websocket", "message %x len %lu\n", input[0], (unsigned long) frag[0].l);
-			uint8_t op = input[0] & WS_OP_MASK;
-			switch (op) {
-				case WS_OP_TEXT:
-				case WS_OP_BIN:
-				case WS_OP_PONG:
-				case WS_OP_CLOS:
-					ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, frag[0].p, frag[0].l);
-					if (op == WS_OP_CLOS) {
-						ws->closed |= PURPLE_INPUT_READ;
-						if (ws->closed & PURPLE_INPUT_WRITE) {
-							purple_websocket_abort(ws);
-							return 0;
-						} else
-							purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
-					}
-					break;
-				case WS_OP_PING:
-					purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, frag[0].p, frag[0].l);
-					break;
-				default:
-					ws_error(ws, "Unknown frame op");
-			}
-			return off;
+	if (op == WS_OP_CONT) {
+		if (!ws->message_header) {
+			ws_error(ws, "Unexpected continuation frame");
+			return 0;
+		}
+		memcpy(buffer_incr(&ws->message, plen), payload, plen);
+		if (header & WS_FIN) {
+			size_t total = ws->message.len;
+			header = ws->message_header;
+			ws->message_header = 0;
+			ws->message.len = 0;
+			return ws_deliver(ws, header, ws->message.buf, total) ? off : 0;
 		}
+		return off;
+	}
+
+	if (ws->message_header) {
+		ws_error(ws, "Expected continuation frame");
+		return 0;
+	}
+	if (header & WS_FIN) {
+		/* the usual case: deliver straight out of the input buffer */
+		return ws_deliver(ws, header, payload, plen) ? off : 0;
 	}
 
-	ws_error(ws, "Maximum fragment count exceeded");
-	return 0;
+	/* first fragment; only fragmented messages get copied, once each, into the assembly buffer */
+	ws->message_header = header;
+	ws->message.len = 0;
+	memcpy(buffer_incr(&ws->message, plen), payload, plen);
+	return off;
 }
 
 static void ws_input_cb(gpointer data, gint source, PurpleInputCondition cond);
 
 static gboolean ws_input(PurpleWebsocket *ws) {
-	if (ws->inpa) {
-		purple_input_remove(ws->inpa);
-		ws->inpa = 0;
-	}
-
 	if (ws->output.off) {
 		/* always none left in practice: */
-		memmove(ws->output.buf, ws->output.buf + ws->output.off, ws->output.len -= ws->output.off);
+		if ((ws->output.len -= ws->output.off))
+			memmove(ws->output.buf, ws->output.buf + ws->output.off, ws->output.len);
 		ws->output.off = 0;
 	}
 
@@ -285,6 +478,16 @@ static gboolean ws_input(PurpleWebsocket *ws) {
 		return FALSE;
 	}
 
+	/* leave the watch alone if it's already waiting for the right thing */
+	if (ws->inpa && cond == ws->inpa_cond)
+		return TRUE;
+
+	if (ws->inpa) {
+		purple_input_remove(ws->inpa);
+		ws->inpa = 0;
+	}
+
+	ws->inpa_cond = cond;
 	if (cond != 0)
 		ws->inpa = purple_input_add(ws->fd, cond, ws_input_cb, ws);
 	return TRUE;
@@ -370,34 +573,79 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 			
 			while (ws->input.off >= ws->input.len) {
 				size_t r = ws_read_message(ws);
-				if (!r) /* error */
+				if (!r) /* error: ws has been freed */
 					return;
-				else if (r > ws->input.off) {
-					/* need more */
+				else if (r > ws->input.off - ws->input_start) {
+					size_t avail = ws->input.off - ws->input_start;
+					/* need more: only now move the partial frame to the front */
+					if (ws->input_start) {
+						memmove(ws->input.buf, ws->input.buf + ws->input_start, avail);
+						ws->input.off = avail;
+						ws->input_start = 0;
+					}
 					buffer_set_len(&ws->input, r);
-				} else {
-					/* consumed some */
-					memmove(ws->input.buf, ws->input.buf + r, ws->input.off -= r);
+				} else if ((ws->input_start += r) == ws->input.off) {
+					/* consumed everything, start again at the front for free */
+					ws->input_start = ws->input.off = 0;
 					ws->input.len = 2;
-				}
+				} else
+					buffer_set_len(&ws->input, ws->input_start + 2);
 			}
 		}
 	}
 }
 
+/* dst = src ^ mask, where mask repeats every 4 bytes from the start of the payload */
+static void ws_mask(guchar *dst, const guchar *src, size_t len, uint32_t mask) {
+	size_t i = 0;
+	uint64_t mask64;
+
+	memcpy(&mask64, &mask, 4);
+	memcpy((guchar *)&mask64 + 4, &mask, 4);
+
+#ifdef __SSE2__
+	__m128i mask128 = _mm_set1_epi32((int)mask);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(v, mask128));
+	}
+#endif
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, &src[i], 8);
+		v ^= mask64;
+		memcpy(&dst[i], &v, 8);
+	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ ((uint8_t*)&mask)[i&3];
+}
+
 void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
 	g_return_if_fail(ws);
 	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
 	g_return_if_fail(!(op & ~WS_OP_MASK));
 	gboolean buf = ws->output.len;
+	uint8_t rsv = 0;
+
+	if (ws->deflate_bits && (op == PURPLE_WEBSOCKET_TEXT || op == PURPLE_WEBSOCKET_BINARY) &&
+			len >= WS_DEFLATE_MIN && ws_deflate(ws, msg, len)) {
+		msg = ws->deflated.buf;
+		len = ws->deflated.len;
+		rsv = WS_RSV1;
+	}
 
-#define ADDB(V) (*(uint8_t*)buffer_incr(&ws->output, 1) = (V))
+	/* build the header on the stack so the frame costs a single append */
+	guchar header[14];
+	size_t hlen = 0;
+
+#define ADDB(V) (header[hlen++] = (V))
 #define ADD(T, V) ({ \
 		T _v = (V); \
-		memcpy(buffer_incr(&ws->output, sizeof(T)), &_v, sizeof(T)); \
+		memcpy(&header[hlen], &_v, sizeof(T)); \
+		hlen += sizeof(T); \
 	})
 
-	ADDB(WS_FIN | op);
+	ADDB(WS_FIN | rsv | op);
 	if (len > UINT16_MAX) {
 		ADDB(WS_MASK | 127);
 		ADD(uint64_t, GUINT64_TO_BE(len));
@@ -414,14 +662,9 @@ void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guch
 #undef ADD
 #undef ADDB
 
-	guchar *p = buffer_incr(&ws->output, len);
-	size_t i;
-	for (i = 0; i+3 < len; i+=4) {
-		uint32_t m = *(uint32_t*)&msg[i] ^ mask;
-		memcpy(&p[i], &m, 4);
-	}
-	for (; i < len; i++)
-		p[i] = msg[i] ^ ((uint8_t*)&mask)[i&3];
+	guchar *p = buffer_incr(&ws->output, hlen + len);
+	memcpy(p, header, hlen);
+	ws_mask(p + hlen, msg, len, mask);
 
 	if (op == PURPLE_WEBSOCKET_CLOSE)
 		ws->closed |= PURPLE_INPUT_WRITE;
@@ -616,7 +859,8 @@ Host: %s\r\n\
 Connection: Upgrade\r\n\
 Upgrade: websocket\r\n\
 Sec-WebSocket-Key: %s\r\n\
-Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
+Sec-WebSocket-Version: 13\r\n\
+Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n", path, host, ws->key);
 		if (protocol)
 			g_string_append_printf(request, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 		g_string_append(request, "\r\n");
@@ -40,10 +40,16 @@
 #define z_const
 #endif
 
-#define PURPLE_HTTP_URL_CREDENTIALS_CHARS "a-z0-9.,~_/*!&%?=+\\^-"
+/* allowed in URL credentials, besides letters and digits */
+#define PURPLE_HTTP_URL_CREDENTIALS_PUNCT ".,~_/*!&%?=+^-"
 #define PURPLE_HTTP_MAX_RECV_BUFFER_LEN 102400
 #define PURPLE_HTTP_MAX_READ_BUFFER_LEN 102400
-#define PURPLE_HTTP_GZ_BUFF_LEN 1024
+/* minimum room made in the output buffer for each inflate() call */
+#define PURPLE_HTTP_GZ_BUFF_LEN 16384
+#ifndef PURPLE_HTTP_READ_SIZE
+/* bytes read from a socket at once, on the stack */
+#define PURPLE_HTTP_READ_SIZE 16384
+#endif
 
 #define PURPLE_HTTP_REQUEST_DEFAULT_MAX_REDIRECTS 20
 #define PURPLE_HTTP_REQUEST_DEFAULT_TIMEOUT 30
@@ -52,6 +58,13 @@
 
 #define PURPLE_HTTP_PROGRESS_WATCHER_DEFAULT_INTERVAL 250000
 
+/* one slot per second; longer timers go around more than once */
+#define PURPLE_HTTP_WHEEL_SLOTS 64
+
+typedef struct _PurpleHttpTimer PurpleHttpTimer;
+
+typedef void (*PurpleHttpTimerFunc)(gpointer data);
+
 typedef struct _PurpleHttpSocket PurpleHttpSocket;
 
 typedef struct _PurpleHttpHeaders PurpleHttpHeaders;
@@ -62,6 +75,17 @@ typedef struct _PurpleHttpKeepaliveRequest PurpleHttpKeepaliveRequest;
 
 typedef struct _PurpleHttpGzStream PurpleHttpGzStream;
 
+/* An entry of the timer wheel, embedded in the structure it belongs to. */
+struct _PurpleHttpTimer
+{
+	PurpleHttpTimerFunc func;
+	gpointer data;
+	gint64 expires; /* tick, see purple_http_wheel_now() */
+
+	PurpleHttpTimer **head; /* list it is linked in, NULL if not armed */
+	PurpleHttpTimer *prev, *next;
+};
+
 struct _PurpleHttpSocket
 {
 	PurpleSocket *ps;
@@ -69,6 +93,18 @@ struct _PurpleHttpSocket
 	gboolean is_busy;
 	guint use_count;
 	PurpleHttpKeepaliveHost *host;
+	GList *idle_link; /* position in host->idle, NULL if busy */
+	PurpleHttpTimer idle_timer;
+
+	gboolean is_broken; /* must not be reused for another request */
+
+	/* PurpleHttpConnection whose requests are written and which await a
+	 * response, in request order; the head one is reading. Only used for
+	 * pipelined (GET) requests. */
+	GQueue pipeline;
+	GString *pending_output; /* pipelined requests not yet written */
+	GString *leftover; /* data read past the end of the previous response */
+	guint pipeline_timeout;
 };
 
 struct _PurpleHttpRequest
@@ -78,8 +114,10 @@ struct _PurpleHttpRequest
 	gchar *url;
 	gchar *method;
 	PurpleHttpHeaders *headers;
+	gchar *header_block;
 	PurpleHttpCookieJar *cookie_jar;
 	PurpleHttpKeepalivePool *keepalive_pool;
+	PurpleHttpPriority priority;
 
 	gchar *contents;
 	int contents_length;
@@ -102,6 +140,7 @@ struct _PurpleHttpConnection
 	gboolean is_reading;
 	gboolean is_keepalive;
 	gboolean is_cancelling;
+	gboolean pipeline_failed;
 
 	PurpleHttpURL *url;
 	PurpleHttpRequest *request;
@@ -129,13 +168,13 @@ struct _PurpleHttpConnection
 
 	GList *link_global, *link_gc;
 
-	guint timeout_handle;
+	PurpleHttpTimer timeout_timer;
 
 	PurpleHttpProgressWatcher watcher;
 	gpointer watcher_user_data;
 	guint watcher_interval_threshold;
 	gint64 watcher_last_call;
-	guint watcher_delayed_handle;
+	PurpleHttpTimer watcher_timer;
 };
 
 struct _PurpleHttpResponse
@@ -160,8 +199,9 @@ struct _PurpleHttpURL
 
 struct _PurpleHttpHeaders
 {
-	GList *list;
-	GHashTable *by_name;
+	GList *list, *list_tail;
+	GHashTable *by_name; /* case-insensitive keys */
+	GStringChunk *strings; /* keys and values, freed all at once */
 };
 
 typedef struct
@@ -185,6 +225,8 @@ struct _PurpleHttpKeepaliveRequest
 
 	PurpleHttpKeepaliveHost *host;
 	PurpleHttpSocket *hs;
+	PurpleHttpPriority priority;
+	GList *queue_link; /* position in host->queue, NULL if dequeued */
 };
 
 struct _PurpleHttpKeepaliveHost
@@ -196,8 +238,12 @@ struct _PurpleHttpKeepaliveHost
 	gboolean is_ssl;
 
 	GSList *sockets; /* list of PurpleHttpSocket */
+	guint sockets_count;
+	guint connecting_count; /* sockets still in the TCP/TLS handshake */
+	GQueue idle; /* PurpleHttpSocket, most recently released at tail */
 
-	GSList *queue; /* list of PurpleHttpKeepaliveRequest */
+	/* PurpleHttpKeepaliveRequest, FIFO per PurpleHttpPriority */
+	GQueue queue[PURPLE_HTTP_PRIORITY_LOW + 1];
 	guint process_queue_timeout;
 };
 
@@ -208,6 +254,10 @@ struct _PurpleHttpKeepalivePool
 	int ref_count;
 
 	guint limit_per_host;
+	guint idle_timeout; /* seconds, 0 for no limit */
+
+	/* key: hostname, value: max requests in flight per connection */
+	GHashTable *pipelining;
 
 	/* key: purple_http_socket_hash, value: PurpleHttpKeepaliveHost */
 	GHashTable *by_hash;
@@ -227,6 +277,7 @@ struct _PurpleHttpGzStream
 	gsize max_output;
 	gsize decompressed;
 	GString *pending;
+	GString *scratch; /* output for response writers, reused */
 };
 
 static time_t purple_http_rfc1123_to_time(const gchar *str);
@@ -252,18 +303,22 @@ gchar * purple_http_cookie_jar_dump(PurpleHttpCookieJar *cjar);
 static PurpleHttpKeepaliveRequest *
 purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl,
-	PurpleSocketConnectCb cb, gpointer user_data);
+	PurpleHttpPriority priority, PurpleSocketConnectCb cb,
+	gpointer user_data);
 static void
 purple_http_keepalive_pool_request_cancel(PurpleHttpKeepaliveRequest *req);
 static void
 purple_http_keepalive_pool_release(PurpleHttpSocket *hs, gboolean invalidate);
+static PurpleHttpSocket *
+purple_http_keepalive_pool_pipeline(PurpleHttpKeepalivePool *pool,
+	const gchar *host, int port, gboolean is_ssl,
+	PurpleHttpPriority priority);
 
 static void
 purple_http_connection_set_remove(PurpleHttpConnectionSet *set,
 	PurpleHttpConnection *http_conn);
 
-static GRegex *purple_http_re_url, *purple_http_re_url_host,
-	*purple_http_re_rfc1123;
+static GRegex *purple_http_re_rfc1123;
 
 /*
  * Values: pointers to running PurpleHttpConnection.
@@ -288,6 +343,120 @@ static GHashTable *purple_http_cancelling_gc;
  */
 static GHashTable *purple_http_hc_by_ptr;
 
+/*** Timer wheel **************************************************************/
+
+/* All request deadlines, delayed progress notifications and keep-alive idle
+ * expiries share one wheel, driven by a single 1-second timeout that only
+ * runs while something is armed. Arming and disarming are O(1). */
+static struct
+{
+	PurpleHttpTimer *slots[PURPLE_HTTP_WHEEL_SLOTS];
+	PurpleHttpTimer *due;
+	gint64 tick; /* last processed tick */
+	guint armed;
+	guint source;
+} purple_http_wheel;
+
+static gint64 purple_http_wheel_now(void)
+{
+	return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+static void purple_http_timer_link(PurpleHttpTimer *timer,
+	PurpleHttpTimer **head)
+{
+	timer->head = head;
+	timer->prev = NULL;
+	timer->next = *head;
+	if (*head != NULL)
+		(*head)->prev = timer;
+	*head = timer;
+}
+
+static void purple_http_timer_unlink(PurpleHttpTimer *timer)
+{
+	if (timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		*timer->head = timer->next;
+	if (timer->next != NULL)
+		timer->next->prev = timer->prev;
+	timer->head = NULL;
+	timer->prev = timer->next = NULL;
+}
+
+static gboolean purple_http_timer_is_active(PurpleHttpTimer *timer)
+{
+	return (timer->head != NULL);
+}
+
+static void purple_http_timer_stop(PurpleHttpTimer *timer)
+{
+	if (!purple_http_timer_is_active(timer))
+		return;
+
+	purple_http_timer_unlink(timer);
+	purple_http_wheel.armed--;
+}
+
+static gboolean purple_http_wheel_tick(gpointer unused)
+{
+	PurpleHttpTimer *timer, *next;
+	gint64 now = purple_http_wheel_now();
+	gint64 steps, i;
+
+	/* After a long stall every slot is visited once. */
+	steps = MIN(now - purple_http_wheel.tick, PURPLE_HTTP_WHEEL_SLOTS);
+	for (i = 1; i <= steps; i++) {
+		PurpleHttpTimer **slot = &purple_http_wheel.slots[
+			(purple_http_wheel.tick + i) % PURPLE_HTTP_WHEEL_SLOTS];
+
+		for (timer = *slot; timer != NULL; timer = next) {
+			next = timer->next;
+			if (timer->expires > now)
+				continue;
+			purple_http_timer_unlink(timer);
+			purple_http_timer_link(timer, &purple_http_wheel.due);
+		}
+	}
+	if (now > purple_http_wheel.tick)
+		purple_http_wheel.tick = now;
+
+	/* A callback may stop (or free) any other due timer, so take them
+	 * one at a time. */
+	while ((timer = purple_http_wheel.due) != NULL) {
+		purple_http_timer_stop(timer);
+		timer->func(timer->data);
+	}
+
+	if (purple_http_wheel.armed > 0)
+		return TRUE;
+
+	purple_http_wheel.source = 0;
+	return FALSE;
+}
+
+static void purple_http_timer_start(PurpleHttpTimer *timer, guint seconds,
+	PurpleHttpTimerFunc func, gpointer data)
+{
+	purple_http_timer_stop(timer);
+
+	if (purple_http_wheel.armed == 0)
+		purple_http_wheel.tick = purple_http_wheel_now();
+
+	timer->func = func;
+	timer->data = data;
+	timer->expires = purple_http_wheel_now() + MAX(seconds, 1);
+	purple_http_timer_link(timer, &purple_http_wheel.slots[
+		timer->expires % PURPLE_HTTP_WHEEL_SLOTS]);
+	purple_http_wheel.armed++;
+
+	if (purple_http_wheel.source == 0) {
+		purple_http_wheel.source = purple_timeout_add_seconds(1,
+			purple_http_wheel_tick, NULL);
+	}
+}
+
 /*** Helper functions *********************************************************/
 
 static time_t purple_http_rfc1123_to_time(const gchar *str)
@@ -372,19 +541,21 @@ purple_http_gz_new(gsize max_output, gboolean is_deflate)
 	return gzs;
 }
 
-static GString *
-purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
+/* Inflates straight into the end of out, growing it as needed. */
+static gboolean
+purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len,
+	GString *out)
 {
 	const gchar *compressed_buff;
 	gsize compressed_len;
-	GString *ret;
 	z_stream *zs;
 
-	g_return_val_if_fail(gzs != NULL, NULL);
-	g_return_val_if_fail(buf != NULL, NULL);
+	g_return_val_if_fail(gzs != NULL, FALSE);
+	g_return_val_if_fail(buf != NULL, FALSE);
+	g_return_val_if_fail(out != NULL, FALSE);
 
 	if (gzs->failed)
-		return NULL;
+		return FALSE;
 
 	zs = &gzs->zs;
 
@@ -400,17 +571,23 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 	zs->next_in = (z_const Bytef*)compressed_buff;
 	zs->avail_in = compressed_len;
 
-	ret = g_string_new(NULL);
 	while (zs->avail_in > 0) {
 		int gzres;
-		gchar decompressed_buff[PURPLE_HTTP_GZ_BUFF_LEN];
-		gsize decompressed_len;
-
-		zs->next_out = (Bytef*)decompressed_buff;
-		zs->avail_out = sizeof(decompressed_buff);
-		decompressed_len = zs->avail_out;
+		gsize start = out->len, room, decompressed_len;
+
+		/* Typical JSON inflates several times over; make room for
+		 * that at once, but never past max_output. */
+		room = MAX(PURPLE_HTTP_GZ_BUFF_LEN, zs->avail_in * 4);
+		room = MIN(room, gzs->max_output - gzs->decompressed);
+		if (room == 0)
+			room = 1;
+		g_string_set_size(out, start + room);
+
+		zs->next_out = (Bytef*)out->str + start;
+		zs->avail_out = room;
 		gzres = inflate(zs, Z_FULL_FLUSH);
-		decompressed_len -= zs->avail_out;
+		decompressed_len = room - zs->avail_out;
+		g_string_truncate(out, start + decompressed_len);
 
 		zs->next_out = NULL;
 		zs->avail_out = 0;
@@ -425,11 +602,10 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 					" decompressed data is reached\n");
 				decompressed_len = gzs->max_output -
 					gzs->decompressed;
+				g_string_truncate(out, start + decompressed_len);
 				gzres = Z_STREAM_END;
 			}
 			gzs->decompressed += decompressed_len;
-			g_string_append_len(ret, decompressed_buff,
-				decompressed_len);
 			if (gzres == Z_STREAM_END)
 				break;
 		} else {
@@ -437,8 +613,7 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 				"Decompression failed (%d): %s\n", gzres,
 				zs->msg);
 			gzs->failed = TRUE;
-			g_string_free(ret, TRUE);
-			return NULL;
+			return FALSE;
 		}
 	}
 
@@ -452,7 +627,19 @@ purple_http_gz_put(PurpleHttpGzStream *gzs, const gchar *buf, gsize len)
 			zs->avail_in);
 	}
 
-	return ret;
+	return TRUE;
+}
+
+/* An emptied buffer to inflate into when there's no response->contents. */
+static GString *
+purple_http_gz_scratch(PurpleHttpGzStream *gzs)
+{
+	if (gzs->scratch == NULL)
+		gzs->scratch = g_string_sized_new(PURPLE_HTTP_GZ_BUFF_LEN);
+	else
+		g_string_truncate(gzs->scratch, 0);
+
+	return gzs->scratch;
 }
 
 static void
@@ -463,6 +650,8 @@ purple_http_gz_free(PurpleHttpGzStream *gzs)
 	inflateEnd(&gzs->zs);
 	if (gzs->pending)
 		g_string_free(gzs->pending, TRUE);
+	if (gzs->scratch)
+		g_string_free(gzs->scratch, TRUE);
 	g_free(gzs);
 }
 
@@ -506,6 +695,15 @@ purple_http_socket_close_free(PurpleHttpSocket *hs)
 	if (purple_debug_is_verbose())
 		purple_debug_misc("http", "destroying socket: %p\n", hs);
 
+	purple_http_timer_stop(&hs->idle_timer);
+	if (hs->pipeline_timeout > 0)
+		purple_timeout_remove(hs->pipeline_timeout);
+	g_queue_clear(&hs->pipeline);
+	if (hs->pending_output != NULL)
+		g_string_free(hs->pending_output, TRUE);
+	if (hs->leftover != NULL)
+		g_string_free(hs->leftover, TRUE);
+
 	purple_socket_destroy(hs->ps);
 	g_free(hs);
 }
@@ -527,21 +725,33 @@ static gboolean purple_http_headers_match(PurpleHttpHeaders *hdrs,
 	const gchar *key, const gchar *value);
 static gchar * purple_http_headers_dump(PurpleHttpHeaders *hdrs);
 
-static PurpleHttpHeaders * purple_http_headers_new(void)
+/* Header names are case-insensitive; hashing them this way saves lowercased
+ * copies for every header stored and every lookup. */
+static guint purple_http_str_ihash(gconstpointer key)
 {
-	PurpleHttpHeaders *hdrs = g_new0(PurpleHttpHeaders, 1);
+	const gchar *p;
+	guint h = 5381;
 
-	hdrs->by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-		(GDestroyNotify)g_list_free);
+	for (p = key; *p != '\0'; p++)
+		h = (h << 5) + h + g_ascii_tolower(*p);
 
-	return hdrs;
+	return h;
 }
 
-static void purple_http_headers_free_kvp(PurpleKeyValuePair *kvp)
+static gboolean purple_http_str_iequal(gconstpointer a, gconstpointer b)
 {
-	g_free(kvp->key);
-	g_free(kvp->value);
-	g_free(kvp);
+	return (g_ascii_strcasecmp(a, b) == 0);
+}
+
+static PurpleHttpHeaders * purple_http_headers_new(void)
+{
+	PurpleHttpHeaders *hdrs = g_new0(PurpleHttpHeaders, 1);
+
+	hdrs->by_name = g_hash_table_new_full(purple_http_str_ihash,
+		purple_http_str_iequal, NULL, (GDestroyNotify)g_list_free);
+	hdrs->strings = g_string_chunk_new(512);
+
+	return hdrs;
 }
 
 static void purple_http_headers_free(PurpleHttpHeaders *hdrs)
@@ -550,8 +760,8 @@ static void purple_http_headers_free(PurpleHttpHeaders *hdrs)
 		return;
 
 	g_hash_table_destroy(hdrs->by_name);
-	g_list_free_full(hdrs->list,
-		(GDestroyNotify)purple_http_headers_free_kvp);
+	g_list_free_full(hdrs->list, g_free);
+	g_string_chunk_free(hdrs->strings);
 	g_free(hdrs);
 }
 
@@ -559,25 +769,33 @@ static void purple_http_headers_add(PurpleHttpHeaders *hdrs, const gchar *key,
 	const gchar *value)
 {
 	PurpleKeyValuePair *kvp;
-	GList *named_values, *new_values;
-	gchar *key_low;
+	GList *named_values, *link;
 
 	g_return_if_fail(hdrs != NULL);
 	g_return_if_fail(key != NULL);
 	g_return_if_fail(value != NULL);
 
 	kvp = g_new0(PurpleKeyValuePair, 1);
-	kvp->key = g_strdup(key);
-	kvp->value = g_strdup(value);
-	hdrs->list = g_list_append(hdrs->list, kvp);
+	kvp->key = g_string_chunk_insert(hdrs->strings, key);
+	kvp->value = g_string_chunk_insert(hdrs->strings, value);
+
+	/* append in O(1) */
+	link = g_list_alloc();
+	link->data = kvp;
+	link->prev = hdrs->list_tail;
+	if (hdrs->list_tail != NULL)
+		hdrs->list_tail->next = link;
+	else
+		hdrs->list = link;
+	hdrs->list_tail = link;
 
-	key_low = g_ascii_strdown(key, -1);
-	named_values = g_hash_table_lookup(hdrs->by_name, key_low);
-	new_values = g_list_append(named_values, kvp->value);
+	named_values = g_hash_table_lookup(hdrs->by_name, kvp->key);
 	if (named_values)
-		g_free(key_low);
-	else
-		g_hash_table_insert(hdrs->by_name, key_low, new_values);
+		named_values = g_list_append(named_values, kvp->value);
+	else {
+		g_hash_table_insert(hdrs->by_name, kvp->key,
+			g_list_append(NULL, kvp->value));
+	}
 }
 
 static void purple_http_headers_remove(PurpleHttpHeaders *hdrs,
@@ -600,8 +818,11 @@ static void purple_http_headers_remove(PurpleHttpHeaders *hdrs,
 		if (g_ascii_strcasecmp(kvp->key, key) != 0)
 			continue;
 
+		if (curr == hdrs->list_tail)
+			hdrs->list_tail = curr->prev;
 		hdrs->list = g_list_delete_link(hdrs->list, curr);
-		purple_http_headers_free_kvp(kvp);
+		/* its strings stay in hdrs->strings until it's freed */
+		g_free(kvp);
 	}
 }
 
@@ -616,17 +837,10 @@ static const GList * purple_http_headers_get_all(PurpleHttpHeaders *hdrs)
 static GList * purple_http_headers_get_all_by_name(
 	PurpleHttpHeaders *hdrs, const gchar *key)
 {
-	GList *values;
-	gchar *key_low;
-
 	g_return_val_if_fail(hdrs != NULL, NULL);
 	g_return_val_if_fail(key != NULL, NULL);
 
-	key_low = g_ascii_strdown(key, -1);
-	values = g_hash_table_lookup(hdrs->by_name, key_low);
-	g_free(key_low);
-
-	return values;
+	return g_hash_table_lookup(hdrs->by_name, key);
 }
 
 static const gchar * purple_http_headers_get(PurpleHttpHeaders *hdrs,
@@ -842,6 +1056,9 @@ static void _purple_http_gen_headers(PurpleHttpConnection *hc)
 			kvp->key, (gchar*)kvp->value);
 	}
 
+	if (req->header_block != NULL)
+		g_string_append(h, req->header_block);
+
 	if (!purple_http_cookie_jar_is_empty(req->cookie_jar)) {
 		gchar * cookies = purple_http_cookie_jar_gen(req->cookie_jar);
 		g_string_append_printf(h, "Cookie: %s\r\n", cookies);
@@ -856,6 +1073,21 @@ static void _purple_http_gen_headers(PurpleHttpConnection *hc)
 	}
 }
 
+/* Data past the end of the current response belongs to the next one on the
+ * same socket (pipelining), keep it for that one. */
+static void _purple_http_recv_excess(PurpleHttpConnection *hc,
+	const gchar *buf, int len)
+{
+	PurpleHttpSocket *hs = hc->socket;
+
+	if (len <= 0 || hs == NULL)
+		return;
+
+	if (hs->leftover == NULL)
+		hs->leftover = g_string_new("");
+	g_string_insert_len(hs->leftover, 0, buf, len);
+}
+
 static gboolean _purple_http_recv_headers(PurpleHttpConnection *hc,
 	const gchar *buf, int len)
 {
@@ -947,25 +1179,39 @@ static gboolean _purple_http_recv_headers(PurpleHttpConnection *hc,
 static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 	const gchar *buf, int len)
 {
-	GString *decompressed = NULL;
+	GString *out = NULL;
+	gsize out_start = 0;
 
 	if (hc->length_expected >= 0 &&
 		len + hc->length_got > (guint)hc->length_expected)
 	{
-		len = hc->length_expected - hc->length_got;
+		int rest = hc->length_expected - hc->length_got;
+
+		_purple_http_recv_excess(hc, buf + rest, len - rest);
+		len = rest;
 	}
 
 	hc->length_got += len;
 
 	if (hc->gz_stream != NULL) {
-		decompressed = purple_http_gz_put(hc->gz_stream, buf, len);
-		if (decompressed == NULL) {
+		/* inflate in place: straight into the response contents, or
+		 * into a reused scratch buffer for the response writer */
+		if (hc->request->response_writer != NULL)
+			out = purple_http_gz_scratch(hc->gz_stream);
+		else {
+			if (hc->response->contents == NULL)
+				hc->response->contents = g_string_new("");
+			out = hc->response->contents;
+		}
+		out_start = out->len;
+
+		if (!purple_http_gz_put(hc->gz_stream, buf, len, out)) {
 			_purple_http_error(hc,
 				_("Error while decompressing data"));
 			return FALSE;
 		}
-		buf = decompressed->str;
-		len = decompressed->len;
+		buf = out->str + out_start;
+		len = out->len - out_start;
 	}
 
 	g_assert(hc->request->max_length <=
@@ -975,14 +1221,16 @@ static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 			"Maximum length exceeded, truncating\n");
 		len = hc->request->max_length - hc->length_got_decompressed;
 		hc->length_expected = hc->length_got;
+		/* the rest of the body is left unread */
+		if (hc->socket != NULL)
+			hc->socket->is_broken = TRUE;
+		if (out != NULL)
+			g_string_truncate(out, out_start + len);
 	}
 	hc->length_got_decompressed += len;
 
-	if (len == 0) {
-		if (decompressed != NULL)
-			g_string_free(decompressed, TRUE);
+	if (len == 0)
 		return TRUE;
-	}
 
 	if (hc->request->response_writer != NULL) {
 		gboolean succ;
@@ -990,23 +1238,18 @@ static gboolean _purple_http_recv_body_data(PurpleHttpConnection *hc,
 			hc->length_got_decompressed, len,
 			hc->request->response_writer_data);
 		if (!succ) {
-			if (decompressed != NULL)
-				g_string_free(decompressed, TRUE);
 			purple_debug_error("http",
 				"Cannot write using callback\n");
 			_purple_http_error(hc,
 				_("Error handling retrieved data"));
 			return FALSE;
 		}
-	} else {
+	} else if (out == NULL) {
 		if (hc->response->contents == NULL)
 			hc->response->contents = g_string_new("");
 		g_string_append_len(hc->response->contents, buf, len);
 	}
 
-	if (decompressed != NULL)
-		g_string_free(decompressed, TRUE);
-
 	purple_http_conn_notify_progress_watcher(hc);
 	return TRUE;
 }
@@ -1088,6 +1331,9 @@ static gboolean _purple_http_recv_body_chunked(PurpleHttpConnection *hc,
 		if (hc->chunk_length == 0) {
 			hc->chunks_done = TRUE;
 			hc->in_chunk = FALSE;
+			_purple_http_recv_excess(hc, hc->response_buffer->str,
+				hc->response_buffer->len);
+			g_string_truncate(hc->response_buffer, 0);
 			return TRUE;
 		}
 	}
@@ -1107,10 +1353,17 @@ static gboolean _purple_http_recv_body(PurpleHttpConnection *hc,
 static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 {
 	int len;
-	gchar buf[4096];
+	gchar buf[PURPLE_HTTP_READ_SIZE];
 	gboolean got_anything;
 
-	len = purple_socket_read(hc->socket->ps, (guchar*)buf, sizeof(buf));
+	if (hc->socket->leftover != NULL && hc->socket->leftover->len > 0) {
+		len = MIN(sizeof(buf), hc->socket->leftover->len);
+		memcpy(buf, hc->socket->leftover->str, len);
+		g_string_erase(hc->socket->leftover, 0, len);
+	} else {
+		len = purple_socket_read(hc->socket->ps, (guchar*)buf,
+			sizeof(buf));
+	}
 	got_anything = (len > 0);
 
 	if (len < 0 && errno == EAGAIN)
@@ -1178,6 +1431,20 @@ static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 			hc->is_chunked = (purple_http_headers_match(
 				hc->response->headers,
 				"Transfer-Encoding", "chunked"));
+			if (hc->is_chunked)
+				hc->length_expected = -1;
+			/* These never have a body, whatever the headers say. */
+			if (hc->response->code == 204 ||
+				hc->response->code == 304)
+			{
+				hc->length_expected = 0;
+				hc->is_chunked = FALSE;
+			}
+			if (purple_http_headers_match(hc->response->headers,
+				"Connection", "close"))
+			{
+				hc->socket->is_broken = TRUE;
+			}
 			is_gzip = purple_http_headers_match(
 				hc->response->headers, "Content-Encoding",
 				"gzip");
@@ -1188,6 +1455,26 @@ static gboolean _purple_http_recv_loopbody(PurpleHttpConnection *hc, gint fd)
 				hc->gz_stream = purple_http_gz_new(
 					hc->request->max_length + 1,
 					is_deflate);
+				/* inflated in place; guess a few times the
+				 * compressed size */
+				if (hc->length_expected > 0 &&
+					hc->request->response_writer == NULL &&
+					hc->response->contents == NULL)
+				{
+					hc->response->contents =
+						g_string_sized_new(MIN(
+						(guint)hc->length_expected,
+						hc->request->max_length / 4) * 4);
+				}
+			} else if (hc->length_expected > 0 &&
+				hc->request->response_writer == NULL &&
+				hc->response->contents == NULL)
+			{
+				/* the body is appended in place, no need to
+				 * grow it step by step */
+				hc->response->contents = g_string_sized_new(
+					MIN((guint)hc->length_expected,
+					hc->request->max_length));
 			}
 		}
 		if (hc->headers_got && hc->response_buffer &&
@@ -1313,6 +1600,191 @@ static void _purple_http_recv(gpointer _hc, gint fd, PurpleInputCondition cond)
 	while (_purple_http_recv_loopbody(hc, fd));
 }
 
+/*** Pipelining **************************************************************/
+
+static gboolean _purple_http_can_pipeline(PurpleHttpConnection *hc)
+{
+	PurpleHttpRequest *req = hc->request;
+
+	if (hc->pipeline_failed || req->keepalive_pool == NULL ||
+		req->keepalive_pool->pipelining == NULL || !req->http11)
+	{
+		return FALSE;
+	}
+
+	/* Only requests that are safe to send twice and have no body. */
+	if (!purple_http_request_is_method(req, "get") ||
+		req->contents_length > 0 || req->contents_reader != NULL)
+	{
+		return FALSE;
+	}
+
+	/* Streamed responses may be large; nothing should queue behind one
+	 * and it shouldn't wait behind others either. */
+	if (req->response_writer != NULL)
+		return FALSE;
+
+	return (g_hash_table_lookup(req->keepalive_pool->pipelining,
+		hc->url->host) != NULL);
+}
+
+/* Sends every request queued behind the head of the pipeline (except the
+ * first keep ones) over again, on another connection. */
+static void _purple_http_pipeline_drop(PurpleHttpSocket *hs, guint keep)
+{
+	PurpleHttpConnection *hc;
+
+	while (g_queue_get_length(&hs->pipeline) > keep) {
+		hc = g_queue_pop_tail(&hs->pipeline);
+		hc->socket = NULL;
+		hc->is_reading = FALSE;
+		hc->pipeline_failed = TRUE;
+		purple_http_conn_retry(hc);
+	}
+}
+
+static void _purple_http_pipeline_flush(PurpleHttpSocket *hs)
+{
+	int written;
+
+	if (hs->pending_output == NULL || hs->pending_output->len == 0)
+		return;
+
+	written = purple_socket_write(hs->ps,
+		(const guchar*)hs->pending_output->str,
+		hs->pending_output->len);
+
+	if (written < 0 && errno == EAGAIN)
+		return;
+
+	if (written < 0) {
+		purple_debug_warning("http", "Error writing pipelined "
+			"requests: %s\n", g_strerror(errno));
+		g_string_truncate(hs->pending_output, 0);
+		hs->is_broken = TRUE;
+		_purple_http_pipeline_drop(hs, 1);
+		return;
+	}
+
+	g_string_erase(hs->pending_output, 0, written);
+}
+
+static void _purple_http_pipeline_watch(PurpleHttpSocket *hs);
+
+static void _purple_http_pipeline_io(gpointer _hs, gint fd,
+	PurpleInputCondition cond)
+{
+	PurpleHttpSocket *hs = _hs;
+	PurpleHttpConnection *hc;
+
+	if (cond & PURPLE_INPUT_WRITE) {
+		_purple_http_pipeline_flush(hs);
+		if (hs->pending_output->len == 0)
+			_purple_http_pipeline_watch(hs);
+	}
+
+	if (cond & PURPLE_INPUT_READ) {
+		hc = g_queue_peek_head(&hs->pipeline);
+		if (hc != NULL)
+			_purple_http_recv(hc, fd, cond);
+	}
+}
+
+static void _purple_http_pipeline_watch(PurpleHttpSocket *hs)
+{
+	PurpleInputCondition cond = PURPLE_INPUT_READ;
+
+	if (hs->pending_output != NULL && hs->pending_output->len > 0)
+		cond |= PURPLE_INPUT_WRITE;
+
+	purple_socket_watch(hs->ps, cond, _purple_http_pipeline_io, hs);
+}
+
+/* The next response may already be buffered (in hs->leftover or inside the
+ * TLS layer), so don't wait for the socket to become readable. */
+static gboolean _purple_http_pipeline_next_cb(gpointer _hs)
+{
+	PurpleHttpSocket *hs = _hs;
+	PurpleHttpConnection *hc;
+
+	hs->pipeline_timeout = 0;
+
+	hc = g_queue_peek_head(&hs->pipeline);
+	if (hc != NULL)
+		_purple_http_recv(hc, -1, PURPLE_INPUT_READ);
+
+	return FALSE;
+}
+
+static void _purple_http_pipeline_join(PurpleHttpSocket *hs,
+	PurpleHttpConnection *hc)
+{
+	if (purple_debug_is_verbose()) {
+		purple_debug_misc("http", "pipelining request %p on socket "
+			"%p (%u ahead)\n", hc, hs,
+			g_queue_get_length(&hs->pipeline));
+	}
+
+	hc->socket = hs;
+	hs->use_count++;
+
+	_purple_http_gen_headers(hc);
+	hc->request_header_written = hc->request_header->len;
+	hc->is_reading = TRUE;
+	g_queue_push_tail(&hs->pipeline, hc);
+
+	if (hs->pending_output == NULL)
+		hs->pending_output = g_string_new("");
+	g_string_append_len(hs->pending_output, hc->request_header->str,
+		hc->request_header->len);
+
+	_purple_http_pipeline_flush(hs);
+	_purple_http_pipeline_watch(hs);
+}
+
+/* hc is done with the socket: either hand it to the next request in the
+ * pipeline, or release it. */
+static void _purple_http_pipeline_leave(PurpleHttpSocket *hs,
+	PurpleHttpConnection *hc, gboolean is_graceful)
+{
+	gboolean was_head = (g_queue_peek_head(&hs->pipeline) == hc);
+
+	g_queue_remove(&hs->pipeline, hc);
+
+	if (!was_head) {
+		/* Its response is still on the way and nobody will read past
+		 * it; let the head finish and move the others elsewhere. */
+		hs->is_broken = TRUE;
+		_purple_http_pipeline_drop(hs, 1);
+		return;
+	}
+
+	if (!is_graceful)
+		hs->is_broken = TRUE;
+
+	if (hs->is_broken) {
+		if (!g_queue_is_empty(&hs->pipeline)) {
+			purple_debug_info("http", "Pipelined connection "
+				"closed, retrying %u requests\n",
+				g_queue_get_length(&hs->pipeline));
+		}
+		_purple_http_pipeline_drop(hs, 0);
+		purple_http_keepalive_pool_release(hs, TRUE);
+		return;
+	}
+
+	if (g_queue_is_empty(&hs->pipeline)) {
+		purple_http_keepalive_pool_release(hs, FALSE);
+		return;
+	}
+
+	_purple_http_pipeline_watch(hs);
+	if (hs->pipeline_timeout == 0) {
+		hs->pipeline_timeout = purple_timeout_add(0,
+			_purple_http_pipeline_next_cb, hs);
+	}
+}
+
 static void _purple_http_send_got_data(PurpleHttpConnection *hc,
 	gboolean success, gboolean eof, size_t stored)
 {
@@ -1438,6 +1910,14 @@ static void _purple_http_send(gpointer _hc, gint fd, PurpleInputCondition cond)
 
 	/* request is completely written, let's read the response */
 	hc->is_reading = TRUE;
+	if (_purple_http_can_pipeline(hc) &&
+		g_queue_is_empty(&hc->socket->pipeline))
+	{
+		/* more GETs may be sent behind this one */
+		g_queue_push_tail(&hc->socket->pipeline, hc);
+		_purple_http_pipeline_watch(hc->socket);
+		return;
+	}
 	purple_socket_watch(hc->socket->ps, PURPLE_INPUT_READ,
 		_purple_http_recv, hc);
 }
@@ -1461,7 +1941,12 @@ static void _purple_http_disconnect(PurpleHttpConnection *hc,
 
 	if (hc->socket_request)
 		purple_http_keepalive_pool_request_cancel(hc->socket_request);
-	else {
+	else if (hc->socket && !g_queue_is_empty(&hc->socket->pipeline)) {
+		PurpleHttpSocket *hs = hc->socket;
+
+		hc->socket = NULL;
+		_purple_http_pipeline_leave(hs, hc, is_graceful);
+	} else {
 		purple_http_keepalive_pool_release(hc->socket, !is_graceful);
 		hc->socket = NULL;
 	}
@@ -1491,6 +1976,7 @@ _purple_http_connected(PurpleSocket *ps, const gchar *error, gpointer _hc)
 static gboolean _purple_http_reconnect(PurpleHttpConnection *hc)
 {
 	PurpleHttpURL *url;
+	PurpleHttpSocket *pipeline_hs = NULL;
 	gboolean is_ssl = FALSE;
 
 	g_return_val_if_fail(hc != NULL, FALSE);
@@ -1521,16 +2007,29 @@ static gboolean _purple_http_reconnect(PurpleHttpConnection *hc)
 		return FALSE;
 	}
 
-	if (hc->request->keepalive_pool != NULL) {
+	if (hc->request->keepalive_pool != NULL &&
+		_purple_http_can_pipeline(hc))
+	{
+		pipeline_hs = purple_http_keepalive_pool_pipeline(
+			hc->request->keepalive_pool, url->host, url->port,
+			is_ssl, hc->request->priority);
+	}
+
+	if (pipeline_hs != NULL) {
+		/* joined below, once the response state is reset */
+	} else if (hc->request->keepalive_pool != NULL) {
 		hc->socket_request = purple_http_keepalive_pool_request(
 			hc->request->keepalive_pool, hc->gc, url->host,
-			url->port, is_ssl, _purple_http_connected, hc);
+			url->port, is_ssl, hc->request->priority,
+			_purple_http_connected, hc);
 	} else {
 		hc->socket = purple_http_socket_connect_new(hc->gc, url->host,
 			url->port, is_ssl, _purple_http_connected, hc);
 	}
 
-	if (hc->socket_request == NULL && hc->socket == NULL) {
+	if (hc->socket_request == NULL && hc->socket == NULL &&
+		pipeline_hs == NULL)
+	{
 		_purple_http_error(hc, _("Unable to connect to %s"), url->host);
 		return FALSE;
 	}
@@ -1552,20 +2051,21 @@ static gboolean _purple_http_reconnect(PurpleHttpConnection *hc)
 
 	purple_http_conn_notify_progress_watcher(hc);
 
+	if (pipeline_hs != NULL)
+		_purple_http_pipeline_join(pipeline_hs, hc);
+
 	return TRUE;
 }
 
 /*** Performing HTTP requests *************************************************/
 
-static gboolean purple_http_request_timeout(gpointer _hc)
+static void purple_http_request_timeout(gpointer _hc)
 {
 	PurpleHttpConnection *hc = _hc;
 
 	purple_debug_warning("http", "Timeout reached for request %p\n", hc);
 
 	purple_http_conn_cancel(hc);
-
-	return FALSE;
 }
 
 PurpleHttpConnection * purple_http_get(PurpleConnection *gc,
@@ -1643,10 +2143,14 @@ PurpleHttpConnection * purple_http_request(PurpleConnection *gc,
 		return NULL;
 	}
 
-	_purple_http_reconnect(hc);
+	/* armed first: if connecting fails right away, hc is already gone
+	 * after _purple_http_reconnect() */
+	if (request->timeout >= 0) {
+		purple_http_timer_start(&hc->timeout_timer, request->timeout,
+			purple_http_request_timeout, hc);
+	}
 
-	hc->timeout_handle = purple_timeout_add_seconds(request->timeout,
-		purple_http_request_timeout, hc);
+	_purple_http_reconnect(hc);
 
 	return hc;
 }
@@ -1654,7 +2158,7 @@ PurpleHttpConnection * purple_http_request(PurpleConnection *gc,
 /*** HTTP connection API ******************************************************/
 
 static void purple_http_connection_free(PurpleHttpConnection *hc);
-static gboolean purple_http_conn_notify_progress_watcher_timeout(gpointer _hc);
+static void purple_http_conn_notify_progress_watcher_timeout(gpointer _hc);
 
 static PurpleHttpConnection * purple_http_connection_new(
 	PurpleHttpRequest *request, PurpleConnection *gc)
@@ -1684,10 +2188,8 @@ static PurpleHttpConnection * purple_http_connection_new(
 
 static void purple_http_connection_free(PurpleHttpConnection *hc)
 {
-	if (hc->timeout_handle)
-		purple_timeout_remove(hc->timeout_handle);
-	if (hc->watcher_delayed_handle)
-		purple_timeout_remove(hc->watcher_delayed_handle);
+	purple_http_timer_stop(&hc->timeout_timer);
+	purple_http_timer_stop(&hc->watcher_timer);
 
 	if (hc->connection_set != NULL)
 		purple_http_connection_set_remove(hc->connection_set, hc);
@@ -1876,29 +2378,25 @@ static void purple_http_conn_notify_progress_watcher(
 	if (hc->watcher_last_call + hc->watcher_interval_threshold
 		> now && processed != total)
 	{
-		if (hc->watcher_delayed_handle)
+		if (purple_http_timer_is_active(&hc->watcher_timer))
 			return;
-		hc->watcher_delayed_handle = purple_timeout_add_seconds(
+		purple_http_timer_start(&hc->watcher_timer,
 			1 + hc->watcher_interval_threshold / 1000000,
 			purple_http_conn_notify_progress_watcher_timeout, hc);
 		return;
 	}
 
-	if (hc->watcher_delayed_handle)
-		purple_timeout_remove(hc->watcher_delayed_handle);
-	hc->watcher_delayed_handle = 0;
+	purple_http_timer_stop(&hc->watcher_timer);
 
 	hc->watcher_last_call = now;
 	hc->watcher(hc, reading_state, processed, total, hc->watcher_user_data);
 }
 
-static gboolean purple_http_conn_notify_progress_watcher_timeout(gpointer _hc)
+static void purple_http_conn_notify_progress_watcher_timeout(gpointer _hc)
 {
 	PurpleHttpConnection *hc = _hc;
 
 	purple_http_conn_notify_progress_watcher(hc);
-
-	return FALSE;
 }
 
 /*** Cookie jar API ***********************************************************/
@@ -1967,6 +2465,37 @@ PurpleHttpCookieJar * purple_http_cookie_jar_unref(
 	return NULL;
 }
 
+static gboolean purple_http_cookie_is_date_char(gchar c)
+{
+	return g_ascii_isalnum(c) || c == ',' || c == ' ' || c == ':';
+}
+
+/* Finds the first (case-insensitive) "expires=" followed by a date, i.e. what
+ * "expires=([a-z0-9, :]+)" would match. Returns the date and its length. */
+static const gchar * purple_http_cookie_find_expires(const gchar *attrs,
+	gsize *len)
+{
+	const gchar *p, *date;
+
+	for (p = attrs; *p != '\0'; p++) {
+		if (g_ascii_tolower(*p) != 'e' ||
+			g_ascii_strncasecmp(p, "expires=", 8) != 0)
+		{
+			continue;
+		}
+
+		date = p + 8;
+		for (p = date; purple_http_cookie_is_date_char(*p); p++);
+		if (p != date) {
+			*len = p - date;
+			return date;
+		}
+		p = date - 1;
+	}
+
+	return NULL;
+}
+
 static void purple_http_cookie_jar_parse(PurpleHttpCookieJar *cookie_jar,
 	GList *values)
 {
@@ -2000,23 +2529,17 @@ static void purple_http_cookie_jar_parse(PurpleHttpCookieJar *cookie_jar,
 			value = g_strdup(eqsign);
 
 		if (semicolon != NULL) {
-			GMatchInfo *match_info;
-			GRegex *re_expires = g_regex_new( /* XXX: make it static */
-				"expires=([a-z0-9, :]+)",
-				G_REGEX_OPTIMIZE | G_REGEX_CASELESS,
-				G_REGEX_MATCH_NOTEMPTY, NULL);
-
-			g_regex_match(re_expires, semicolon, 0, &match_info);
-			if (g_match_info_matches(match_info)) {
-				gchar *expire_date =
-					g_match_info_fetch(match_info, 1);
+			gsize date_len;
+			const gchar *date =
+				purple_http_cookie_find_expires(semicolon,
+				&date_len);
+
+			if (date != NULL) {
+				gchar *expire_date = g_strndup(date, date_len);
 				expires = purple_http_rfc1123_to_time(
 					expire_date);
 				g_free(expire_date);
 			}
-			g_match_info_free(match_info);
-
-			g_regex_unref(re_expires);
 		}
 
 		purple_http_cookie_jar_set_ext(cookie_jar, name, value, expires);
@@ -2133,11 +2656,18 @@ static void
 purple_http_keepalive_host_free(gpointer _host)
 {
 	PurpleHttpKeepaliveHost *host = _host;
+	PurpleHttpKeepaliveRequest *req;
+	guint i;
 
 	g_free(host->host);
 
-	g_slist_free_full(host->queue,
-		(GDestroyNotify)purple_http_keepalive_pool_request_cancel);
+	for (i = 0; i < G_N_ELEMENTS(host->queue); i++) {
+		while ((req = g_queue_pop_head(&host->queue[i])) != NULL) {
+			req->queue_link = NULL;
+			purple_http_keepalive_pool_request_cancel(req);
+		}
+	}
+	g_queue_clear(&host->idle);
 	g_slist_free_full(host->sockets,
 		(GDestroyNotify)purple_http_socket_close_free);
 
@@ -2171,6 +2701,8 @@ purple_http_keepalive_pool_free(PurpleHttpKeepalivePool *pool)
 		return;
 	pool->is_destroying = TRUE;
 	g_hash_table_destroy(pool->by_hash);
+	if (pool->pipelining != NULL)
+		g_hash_table_destroy(pool->pipelining);
 	g_free(pool);
 }
 
@@ -2201,11 +2733,13 @@ purple_http_keepalive_pool_unref(PurpleHttpKeepalivePool *pool)
 static PurpleHttpKeepaliveRequest *
 purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl,
-	PurpleSocketConnectCb cb, gpointer user_data)
+	PurpleHttpPriority priority, PurpleSocketConnectCb cb,
+	gpointer user_data)
 {
 	PurpleHttpKeepaliveRequest *req;
 	PurpleHttpKeepaliveHost *kahost;
 	gchar *hash;
+	guint i;
 
 	g_return_val_if_fail(pool != NULL, NULL);
 	g_return_val_if_fail(host != NULL, NULL);
@@ -2224,6 +2758,9 @@ purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 		kahost->host = g_strdup(host);
 		kahost->port = port;
 		kahost->is_ssl = is_ssl;
+		g_queue_init(&kahost->idle);
+		for (i = 0; i < G_N_ELEMENTS(kahost->queue); i++)
+			g_queue_init(&kahost->queue[i]);
 
 		g_hash_table_insert(pool->by_hash, g_strdup(hash), kahost);
 	}
@@ -2235,8 +2772,10 @@ purple_http_keepalive_pool_request(PurpleHttpKeepalivePool *pool,
 	req->cb = cb;
 	req->user_data = user_data;
 	req->host = kahost;
+	req->priority = priority;
 
-	kahost->queue = g_slist_append(kahost->queue, req);
+	g_queue_push_tail(&kahost->queue[priority], req);
+	req->queue_link = kahost->queue[priority].tail;
 
 	purple_http_keepalive_host_process_queue(kahost);
 
@@ -2256,6 +2795,12 @@ _purple_http_keepalive_socket_connected(PurpleSocket *ps,
 	if (hs != NULL)
 		hs->use_count++;
 
+	/* Requests held back by the first handshake may go now. */
+	if (req->hs != NULL && req->host != NULL) {
+		req->host->connecting_count--;
+		purple_http_keepalive_host_process_queue(req->host);
+	}
+
 	req->cb(ps, error, req->user_data);
 	g_free(req);
 }
@@ -2265,75 +2810,101 @@ _purple_http_keepalive_host_process_queue_cb(gpointer _host)
 {
 	PurpleHttpKeepaliveRequest *req;
 	PurpleHttpKeepaliveHost *host = _host;
-	PurpleHttpSocket *hs = NULL;
-	GSList *it;
-	guint sockets_count;
+	PurpleHttpKeepalivePool *pool;
+	PurpleHttpSocket *hs;
+	guint prio, busy, reserved;
 
 	g_return_val_if_fail(host != NULL, FALSE);
 
 	host->process_queue_timeout = 0;
+	pool = host->pool;
 
-	if (host->queue == NULL)
-		return FALSE;
+	/* Callbacks below may drop the last reference to the pool; keep it
+	 * (and this host) alive until the whole queue is drained. */
+	purple_http_keepalive_pool_ref(pool);
 
-	sockets_count = 0;
-	it = host->sockets;
-	while (it != NULL) {
-		PurpleHttpSocket *hs_current = it->data;
+	while (!pool->is_destroying) {
+		for (prio = 0; prio < G_N_ELEMENTS(host->queue); prio++) {
+			if (!g_queue_is_empty(&host->queue[prio]))
+				break;
+		}
+		if (prio == G_N_ELEMENTS(host->queue))
+			break;
 
-		sockets_count++;
+		/* There are no free sockets and we cannot create another one.
+		 * The last one is kept for high priority requests, so that
+		 * they never wait behind a backlog of background ones. */
+		busy = host->sockets_count - g_queue_get_length(&host->idle);
+		reserved = (prio != PURPLE_HTTP_PRIORITY_HIGH &&
+			pool->limit_per_host > 1) ? 1 : 0;
+		if (pool->limit_per_host > 0 &&
+			busy + reserved >= pool->limit_per_host)
+		{
+			break;
+		}
 
-		if (!hs_current->is_busy) {
-			hs = hs_current;
+		/* Prefer the most recently released socket, it's the least
+		 * likely to have been closed by the server meanwhile. */
+		hs = g_queue_pop_tail(&host->idle);
+
+		if (hs != NULL)
+			purple_http_timer_stop(&hs->idle_timer);
+
+		/* While the first TLS handshake to a host is in flight, don't
+		 * start more: once it completes the TLS backend has a session
+		 * to resume, so the following ones are abbreviated. The waiting
+		 * requests may also just get that first socket. High priority
+		 * requests don't wait: the handshake in flight may be a slow
+		 * background one (or a pre-warm). */
+		if (hs == NULL && prio != PURPLE_HTTP_PRIORITY_HIGH &&
+			host->is_ssl && host->connecting_count > 0 &&
+			host->connecting_count == host->sockets_count)
+		{
 			break;
 		}
 
-		it = g_slist_next(it);
-	}
+		req = g_queue_pop_head(&host->queue[prio]);
+		req->queue_link = NULL;
 
-	/* There are no free sockets and we cannot create another one. */
-	if (hs == NULL && sockets_count >= host->pool->limit_per_host &&
-		host->pool->limit_per_host > 0)
-	{
-		return FALSE;
-	}
+		if (hs != NULL) {
+			if (purple_debug_is_verbose()) {
+				purple_debug_misc("http", "locking a (previously "
+					"used) socket: %p\n", hs);
+			}
 
-	req = host->queue->data;
-	host->queue = g_slist_remove(host->queue, req);
+			hs->idle_link = NULL;
+			hs->is_busy = TRUE;
+			hs->use_count++;
 
-	if (hs != NULL) {
-		if (purple_debug_is_verbose()) {
-			purple_debug_misc("http", "locking a (previously used) "
-				"socket: %p\n", hs);
-		}
+			req->cb(hs->ps, NULL, req->user_data);
+			g_free(req);
 
-		hs->is_busy = TRUE;
-		hs->use_count++;
+			continue;
+		}
 
-		purple_http_keepalive_host_process_queue(host);
+		hs = purple_http_socket_connect_new(req->gc, req->host->host,
+			req->host->port, req->host->is_ssl,
+			_purple_http_keepalive_socket_connected, req);
+		if (hs == NULL) {
+			purple_debug_error("http", "failed creating new socket\n");
+			req->cb(NULL, _("Unable to connect"), req->user_data);
+			g_free(req);
+			continue;
+		}
 
-		req->cb(hs->ps, NULL, req->user_data);
-		g_free(req);
+		req->hs = hs;
+		hs->is_busy = TRUE;
+		hs->host = host;
 
-		return FALSE;
-	}
+		if (purple_debug_is_verbose())
+			purple_debug_misc("http", "locking a (new) socket: %p\n", hs);
 
-	hs = purple_http_socket_connect_new(req->gc, req->host->host,
-		req->host->port, req->host->is_ssl,
-		_purple_http_keepalive_socket_connected, req);
-	if (hs == NULL) {
-		purple_debug_error("http", "failed creating new socket");
-		return FALSE;
+		host->sockets = g_slist_prepend(host->sockets, hs);
+		host->sockets_count++;
+		host->connecting_count++;
 	}
 
-	req->hs = hs;
-	hs->is_busy = TRUE;
-	hs->host = host;
-
-	if (purple_debug_is_verbose())
-		purple_debug_misc("http", "locking a (new) socket: %p\n", hs);
-
-	host->sockets = g_slist_append(host->sockets, hs);
+	purple_http_keepalive_pool_unref(pool);
 
 	return FALSE;
 }
@@ -2356,13 +2927,21 @@ purple_http_keepalive_pool_request_cancel(PurpleHttpKeepaliveRequest *req)
 	if (req == NULL)
 		return;
 
-	if (req->host != NULL)
-		req->host->queue = g_slist_remove(req->host->queue, req);
+	if (req->host != NULL && req->queue_link != NULL) {
+		g_queue_delete_link(&req->host->queue[req->priority],
+			req->queue_link);
+		req->queue_link = NULL;
+	}
 
 	if (req->hs != NULL) {
 		if (G_LIKELY(req->host)) {
 			req->host->sockets = g_slist_remove(req->host->sockets,
 				req->hs);
+			req->host->sockets_count--;
+			req->host->connecting_count--;
+			if (!req->host->pool->is_destroying)
+				purple_http_keepalive_host_process_queue(
+					req->host);
 		}
 		purple_http_socket_close_free(req->hs);
 		/* req should already be free'd here */
@@ -2372,6 +2951,23 @@ purple_http_keepalive_pool_request_cancel(PurpleHttpKeepaliveRequest *req)
 	}
 }
 
+/* The server has most likely dropped it by now, don't hand it out. */
+static void
+_purple_http_keepalive_idle_expired(gpointer _hs)
+{
+	PurpleHttpSocket *hs = _hs;
+	PurpleHttpKeepaliveHost *host = hs->host;
+
+	if (purple_debug_is_verbose())
+		purple_debug_misc("http", "closing idle socket: %p\n", hs);
+
+	g_queue_delete_link(&host->idle, hs->idle_link);
+	hs->idle_link = NULL;
+	host->sockets = g_slist_remove(host->sockets, hs);
+	host->sockets_count--;
+	purple_http_socket_close_free(hs);
+}
+
 static void
 purple_http_keepalive_pool_release(PurpleHttpSocket *hs, gboolean invalidate)
 {
@@ -2392,9 +2988,22 @@ purple_http_keepalive_pool_release(PurpleHttpSocket *hs, gboolean invalidate)
 		return;
 	}
 
-	if (invalidate) {
+	if (invalidate || hs->is_broken) {
+		if (hs->idle_link != NULL) {
+			g_queue_delete_link(&host->idle, hs->idle_link);
+			hs->idle_link = NULL;
+		}
 		host->sockets = g_slist_remove(host->sockets, hs);
+		host->sockets_count--;
 		purple_http_socket_close_free(hs);
+	} else if (hs->idle_link == NULL) {
+		g_queue_push_tail(&host->idle, hs);
+		hs->idle_link = host->idle.tail;
+		if (host->pool->idle_timeout > 0) {
+			purple_http_timer_start(&hs->idle_timer,
+				host->pool->idle_timeout,
+				_purple_http_keepalive_idle_expired, hs);
+		}
 	}
 
 	purple_http_keepalive_host_process_queue(host);
@@ -2417,6 +3026,167 @@ purple_http_keepalive_pool_get_limit_per_host(PurpleHttpKeepalivePool *pool)
 	return pool->limit_per_host;
 }
 
+void
+purple_http_keepalive_pool_set_idle_timeout(PurpleHttpKeepalivePool *pool,
+	guint seconds)
+{
+	g_return_if_fail(pool != NULL);
+
+	pool->idle_timeout = seconds;
+}
+
+guint
+purple_http_keepalive_pool_get_idle_timeout(PurpleHttpKeepalivePool *pool)
+{
+	g_return_val_if_fail(pool != NULL, 0);
+
+	return pool->idle_timeout;
+}
+
+void
+purple_http_keepalive_pool_set_pipelining(PurpleHttpKeepalivePool *pool,
+	const gchar *host, guint depth)
+{
+	g_return_if_fail(pool != NULL);
+	g_return_if_fail(host != NULL);
+
+	if (depth < 2) {
+		if (pool->pipelining != NULL)
+			g_hash_table_remove(pool->pipelining, host);
+		return;
+	}
+
+	if (pool->pipelining == NULL) {
+		pool->pipelining = g_hash_table_new_full(g_str_hash,
+			g_str_equal, g_free, NULL);
+	}
+	g_hash_table_insert(pool->pipelining, g_strdup(host),
+		GUINT_TO_POINTER(depth));
+}
+
+/* Picks a busy socket to send a GET on, behind the ones already in flight.
+ * Only done when the request would otherwise have to wait for a socket. */
+static PurpleHttpSocket *
+purple_http_keepalive_pool_pipeline(PurpleHttpKeepalivePool *pool,
+	const gchar *host, int port, gboolean is_ssl,
+	PurpleHttpPriority priority)
+{
+	PurpleHttpKeepaliveHost *kahost;
+	PurpleHttpSocket *best = NULL;
+	GSList *it;
+	gchar *hash;
+	guint depth, reserved, length, best_length = 0;
+
+	if (pool->is_destroying || pool->pipelining == NULL)
+		return NULL;
+
+	depth = GPOINTER_TO_UINT(g_hash_table_lookup(pool->pipelining, host));
+	if (depth < 2)
+		return NULL;
+
+	hash = purple_http_socket_hash(host, port, is_ssl);
+	kahost = g_hash_table_lookup(pool->by_hash, hash);
+	g_free(hash);
+
+	if (kahost == NULL || !g_queue_is_empty(&kahost->idle))
+		return NULL;
+
+	/* Same rule as _purple_http_keepalive_host_process_queue_cb(). */
+	reserved = (priority != PURPLE_HTTP_PRIORITY_HIGH &&
+		pool->limit_per_host > 1) ? 1 : 0;
+	if (pool->limit_per_host == 0 ||
+		kahost->sockets_count + reserved < pool->limit_per_host)
+	{
+		return NULL;
+	}
+
+	for (it = kahost->sockets; it != NULL; it = g_slist_next(it)) {
+		PurpleHttpSocket *hs = it->data;
+		PurpleHttpConnection *head;
+
+		length = g_queue_get_length(&hs->pipeline);
+		if (hs->is_broken || length == 0 || length >= depth)
+			continue;
+
+		/* Only queue behind a response known to end soon: its
+		 * Content-Length must already be in. */
+		head = g_queue_peek_head(&hs->pipeline);
+		if (!head->headers_got || head->is_chunked ||
+			head->length_expected < 0 ||
+			head->request->response_writer != NULL)
+		{
+			continue;
+		}
+		if (best == NULL || length < best_length) {
+			best = hs;
+			best_length = length;
+		}
+	}
+
+	return best;
+}
+
+static void
+_purple_http_keepalive_prewarm_cb(PurpleSocket *ps, const gchar *error,
+	gpointer _unused)
+{
+	PurpleHttpSocket *hs;
+
+	/* Cancelled before any socket was created. */
+	if (ps == NULL)
+		return;
+
+	hs = purple_socket_get_data(ps, "hs");
+	if (hs == NULL)
+		return;
+
+	if (error != NULL) {
+		purple_debug_warning("http", "prewarming %s failed: %s\n",
+			hs->host ? hs->host->host : "(unknown)", error);
+	}
+
+	/* Park the connected socket as idle, so the first real request
+	 * skips name resolution and the TCP/TLS handshakes. */
+	purple_http_keepalive_pool_release(hs, error != NULL);
+}
+
+void
+purple_http_keepalive_pool_prewarm(PurpleHttpKeepalivePool *pool,
+	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl)
+{
+	PurpleHttpKeepaliveHost *kahost;
+	gchar *hash;
+	guint i;
+
+	g_return_if_fail(pool != NULL);
+	g_return_if_fail(host != NULL);
+
+	if (port <= 0)
+		port = is_ssl ? 443 : 80;
+
+	hash = purple_http_socket_hash(host, port, is_ssl);
+	kahost = g_hash_table_lookup(pool->by_hash, hash);
+	g_free(hash);
+
+	/* Already connected (or connecting) - nothing to warm up. */
+	if (kahost != NULL) {
+		if (kahost->sockets_count > 0)
+			return;
+		for (i = 0; i < G_N_ELEMENTS(kahost->queue); i++) {
+			if (!g_queue_is_empty(&kahost->queue[i]))
+				return;
+		}
+	}
+
+	if (purple_debug_is_verbose()) {
+		purple_debug_misc("http", "prewarming a socket to %s:%d\n",
+			host, port);
+	}
+
+	purple_http_keepalive_pool_request(pool, gc, host, port, is_ssl,
+		PURPLE_HTTP_PRIORITY_LOW, _purple_http_keepalive_prewarm_cb, NULL);
+}
+
 /*** HTTP connection set API **************************************************/
 
 PurpleHttpConnectionSet *
@@ -2498,6 +3268,7 @@ PurpleHttpRequest * purple_http_request_new(const gchar *url)
 	request->max_redirects = PURPLE_HTTP_REQUEST_DEFAULT_MAX_REDIRECTS;
 	request->http11 = TRUE;
 	request->max_length = PURPLE_HTTP_REQUEST_DEFAULT_MAX_LENGTH;
+	request->priority = PURPLE_HTTP_PRIORITY_NORMAL;
 
 	return request;
 }
@@ -2513,6 +3284,7 @@ static void purple_http_request_free(PurpleHttpRequest *request)
 	request->keepalive_pool = NULL;
 	
 	g_free(request->method);
+	g_free(request->header_block);
 	g_free(request->contents);
 	g_free(request->url);
 	g_free(request);
@@ -2628,6 +3400,22 @@ purple_http_request_get_keepalive_pool(PurpleHttpRequest *request)
 	return request->keepalive_pool;
 }
 
+void purple_http_request_set_priority(PurpleHttpRequest *request,
+	PurpleHttpPriority priority)
+{
+	g_return_if_fail(request != NULL);
+	g_return_if_fail(priority <= PURPLE_HTTP_PRIORITY_LOW);
+
+	request->priority = priority;
+}
+
+PurpleHttpPriority purple_http_request_get_priority(PurpleHttpRequest *request)
+{
+	g_return_val_if_fail(request != NULL, PURPLE_HTTP_PRIORITY_NORMAL);
+
+	return request->priority;
+}
+
 void purple_http_request_set_contents(PurpleHttpRequest *request,
 	const gchar *contents, gsize length)
 {
@@ -2794,6 +3582,15 @@ void purple_http_request_header_set_printf(PurpleHttpRequest *request,
 	g_free(value);
 }
 
+void purple_http_request_set_header_block(PurpleHttpRequest *request,
+	const gchar *block)
+{
+	g_return_if_fail(request != NULL);
+
+	g_free(request->header_block);
+	request->header_block = g_strdup(block);
+}
+
 void purple_http_request_header_add(PurpleHttpRequest *request,
 	const gchar *key, const gchar *value)
 {
@@ -2925,17 +3722,75 @@ const gchar * purple_http_response_get_header(PurpleHttpResponse *response,
 
 /*** URL functions ************************************************************/
 
+static gboolean purple_http_url_is_credentials_char(gchar c)
+{
+	return g_ascii_isalnum(c) ||
+		(c != '\0' && strchr(PURPLE_HTTP_URL_CREDENTIALS_PUNCT, c) != NULL);
+}
+
+static gboolean purple_http_url_is_host_char(gchar c)
+{
+	return g_ascii_isalnum(c) || c == '.' || c == '-';
+}
+
+/* Splits "[username:password@]host[:port]", the part between start and end.
+ * Returns FALSE if it isn't well formed. */
+static gboolean purple_http_url_parse_host(PurpleHttpURL *url,
+	const gchar *start, const gchar *end)
+{
+	const gchar *at, *colon, *p;
+
+	at = memchr(start, '@', end - start);
+	if (at != NULL) {
+		colon = memchr(start, ':', at - start);
+		if (colon == NULL || colon == start || colon + 1 == at)
+			return FALSE;
+		for (p = start; p < at; p++) {
+			if (p != colon && !purple_http_url_is_credentials_char(*p))
+				return FALSE;
+		}
+		url->username = g_strndup(start, colon - start);
+		url->password = g_strndup(colon + 1, at - colon - 1);
+		start = at + 1;
+	}
+
+	for (p = start; p < end && purple_http_url_is_host_char(*p); p++);
+	if (p == start)
+		return FALSE;
+	url->host = g_ascii_strdown(start, p - start);
+
+	if (p < end) {
+		const gchar *port = p + 1;
+
+		if (*p != ':' || port == end)
+			return FALSE;
+		for (p = port; p < end; p++) {
+			if (!g_ascii_isdigit(*p))
+				return FALSE;
+		}
+		/* stops at the end of the digits, i.e. at end */
+		url->port = atoi(port);
+	}
+
+	return TRUE;
+}
+
+/* Single pass over the URL, with the same results as the regular expression
+ * it replaced:
+ *   ^(?:([a-z]+):/*([^/]+))?([^#]*)(?:#(.*))?$
+ * and for the host part:
+ *   ^(?:([credentials]+):([credentials]+)@)?([a-z0-9.-]+)(?::([0-9]+))?$
+ */
 PurpleHttpURL *
 purple_http_url_parse(const char *raw_url)
 {
 	PurpleHttpURL *url;
-	GMatchInfo *match_info;
-
-	gchar *host_full, *tmp;
+	const gchar *p, *host_start = NULL, *host_end = NULL, *hash;
+	gsize protocol_len = 0;
 
 	g_return_val_if_fail(raw_url != NULL, NULL);
 
-	if (!g_regex_match(purple_http_re_url, raw_url, 0, &match_info)) {
+	if (raw_url[0] == '\0') {
 		if (purple_debug_is_verbose() && purple_debug_is_unsafe()) {
 			purple_debug_warning("http",
 				"Invalid URL provided: %s\n",
@@ -2944,40 +3799,34 @@ purple_http_url_parse(const char *raw_url)
 		return NULL;
 	}
 
-	url = g_new0(PurpleHttpURL, 1);
+	/* protocol://host, only if both are there */
+	for (p = raw_url; g_ascii_isalpha(*p); p++);
+	if (p != raw_url && *p == ':') {
+		protocol_len = p - raw_url;
+		for (p++; *p == '/'; p++);
+		host_start = p;
+		for (; *p != '\0' && *p != '/'; p++);
+		host_end = p;
+		if (host_start == host_end)
+			host_start = host_end = NULL;
+	}
+	if (host_start == NULL)
+		p = raw_url;
 
-	url->protocol = g_match_info_fetch(match_info, 1);
-	host_full = g_match_info_fetch(match_info, 2);
-	url->path = g_match_info_fetch(match_info, 3);
-	url->fragment = g_match_info_fetch(match_info, 4);
-	g_match_info_free(match_info);
+	url = g_new0(PurpleHttpURL, 1);
 
-	if (g_strcmp0(url->protocol, "") == 0) {
-		g_free(url->protocol);
-		url->protocol = NULL;
-	} else if (url->protocol != NULL) {
-		tmp = url->protocol;
-		url->protocol = g_ascii_strdown(url->protocol, -1);
-		g_free(tmp);
-	}
-	if (host_full[0] == '\0') {
-		g_free(host_full);
-		host_full = NULL;
-	}
-	if (url->path[0] == '\0') {
-		g_free(url->path);
-		url->path = NULL;
-	}
-	if ((url->protocol == NULL) != (host_full == NULL))
-		purple_debug_warning("http", "Protocol or host not present "
-			"(unlikely case)\n");
+	hash = strchr(p, '#');
+	if (hash != NULL) {
+		url->fragment = g_strdup(hash + 1);
+		if (hash != p)
+			url->path = g_strndup(p, hash - p);
+	} else if (*p != '\0')
+		url->path = g_strdup(p);
 
-	if (host_full) {
-		gchar *port_str;
+	if (host_start != NULL) {
+		url->protocol = g_ascii_strdown(raw_url, protocol_len);
 
-		if (!g_regex_match(purple_http_re_url_host, host_full, 0,
-			&match_info))
-		{
+		if (!purple_http_url_parse_host(url, host_start, host_end)) {
 			if (purple_debug_is_verbose() &&
 				purple_debug_is_unsafe())
 			{
@@ -2986,41 +3835,9 @@ purple_http_url_parse(const char *raw_url)
 					raw_url);
 			}
 
-			g_free(host_full);
 			purple_http_url_free(url);
 			return NULL;
 		}
-
-		url->username = g_match_info_fetch(match_info, 1);
-		url->password = g_match_info_fetch(match_info, 2);
-		url->host = g_match_info_fetch(match_info, 3);
-		port_str = g_match_info_fetch(match_info, 4);
-
-		if (port_str && port_str[0])
-			url->port = atoi(port_str);
-
-		if (url->username[0] == '\0') {
-			g_free(url->username);
-			url->username = NULL;
-		}
-		if (url->password[0] == '\0') {
-			g_free(url->password);
-			url->password = NULL;
-		}
-		if (g_strcmp0(url->host, "") == 0) {
-			g_free(url->host);
-			url->host = NULL;
-		} else if (url->host != NULL) {
-			tmp = url->host;
-			url->host = g_ascii_strdown(url->host, -1);
-			g_free(tmp);
-		}
-
-		g_free(port_str);
-		g_match_info_free(match_info);
-
-		g_free(host_full);
-		host_full = NULL;
 	}
 
 	if (url->host != NULL) {
@@ -3209,33 +4026,6 @@ purple_http_url_get_fragment(const PurpleHttpURL *parsed_url)
 
 void purple_http_init(void)
 {
-	purple_http_re_url = g_regex_new("^"
-
-		"(?:" /* host part beginning */
-		"([a-z]+)\\:/*" /* protocol */
-		"([^/]+)" /* username, password, host, port */
-		")?" /* host part ending */
-
-		"([^#]*)" /* path */
-
-		"(?:#" "(.*)" ")?" /* fragment */
-
-		"$", G_REGEX_OPTIMIZE | G_REGEX_CASELESS,
-		G_REGEX_MATCH_NOTEMPTY, NULL);
-
-	purple_http_re_url_host = g_regex_new("^"
-
-		"(?:" /* user credentials part beginning */
-		"([" PURPLE_HTTP_URL_CREDENTIALS_CHARS "]+)" /* username */
-		"(?::([" PURPLE_HTTP_URL_CREDENTIALS_CHARS "]+))" /* password */
-		"@)?" /* user credentials part ending */
-
-		"([a-z0-9.-]+)" /* host */
-		"(?::([0-9]+))?" /* port*/
-
-		"$", G_REGEX_OPTIMIZE | G_REGEX_CASELESS,
-		G_REGEX_MATCH_NOTEMPTY, NULL);
-
 	purple_http_re_rfc1123 = g_regex_new(
 		"^[a-z]+, " /* weekday */
 		"([0-9]+) " /* date */
@@ -3261,10 +4051,6 @@ static void purple_http_foreach_conn_cancel(gpointer _hc, gpointer user_data)
 
 void purple_http_uninit(void)
 {
-	g_regex_unref(purple_http_re_url);
-	purple_http_re_url = NULL;
-	g_regex_unref(purple_http_re_url_host);
-	purple_http_re_url_host = NULL;
 	g_regex_unref(purple_http_re_rfc1123);
 	purple_http_re_rfc1123 = NULL;
 
@@ -3286,4 +4072,8 @@ void purple_http_uninit(void)
 	purple_http_hc_by_ptr = NULL;
 	g_hash_table_destroy(purple_http_cancelling_gc);
 	purple_http_cancelling_gc = NULL;
+
+	if (purple_http_wheel.source > 0)
+		purple_timeout_remove(purple_http_wheel.source);
+	purple_http_wheel.source = 0;
 }
@@ -83,6 +83,23 @@ typedef struct _PurpleHttpKeepalivePool PurpleHttpKeepalivePool;
  */
 typedef struct _PurpleHttpConnectionSet PurpleHttpConnectionSet;
 
+/**
+ * PurpleHttpPriority:
+ * @PURPLE_HTTP_PRIORITY_HIGH:   Interactive requests, someone is waiting for
+ *                               them.
+ * @PURPLE_HTTP_PRIORITY_NORMAL: The default.
+ * @PURPLE_HTTP_PRIORITY_LOW:    Background work, served when nothing else is
+ *                               pending.
+ *
+ * Scheduling class of a request waiting for a Keep-Alive pool socket.
+ */
+typedef enum
+{
+	PURPLE_HTTP_PRIORITY_HIGH = 0,
+	PURPLE_HTTP_PRIORITY_NORMAL,
+	PURPLE_HTTP_PRIORITY_LOW
+} PurpleHttpPriority;
+
 /**
  * PurpleHttpCallback:
  *
@@ -591,6 +608,26 @@ purple_http_request_set_keepalive_pool(PurpleHttpRequest *request,
 PurpleHttpKeepalivePool *
 purple_http_request_get_keepalive_pool(PurpleHttpRequest *request);
 
+/**
+ * purple_http_request_set_priority:
+ * @request:  The request.
+ * @priority: The scheduling class.
+ *
+ * Sets the order in which the request is given a socket from its KeepAlive
+ * pool. Higher classes are always served first and one socket per host is
+ * kept for %PURPLE_HTTP_PRIORITY_HIGH requests.
+ */
+void purple_http_request_set_priority(PurpleHttpRequest *request,
+	PurpleHttpPriority priority);
+
+/**
+ * purple_http_request_get_priority:
+ * @request: The request.
+ *
+ * Returns: The scheduling class of the request.
+ */
+PurpleHttpPriority purple_http_request_get_priority(PurpleHttpRequest *request);
+
 /**
  * purple_http_request_set_contents:
  * @request:  The request.
@@ -775,6 +812,19 @@ void purple_http_request_header_set_printf(PurpleHttpRequest *request,
 void purple_http_request_header_add(PurpleHttpRequest *request,
 	const gchar *key, const gchar *value);
 
+/**
+ * purple_http_request_set_header_block:
+ * @request: The request.
+ * @block:   Pre-formatted "Name: value\r\n" lines, or NULL to remove.
+ *
+ * Sets a block of headers that is appended verbatim after the ones set with
+ * purple_http_request_header_set(). It must not contain headers generated
+ * by the HTTP layer itself (Host, Connection, Accept, Accept-Encoding,
+ * Content-Length or Cookie).
+ */
+void purple_http_request_set_header_block(PurpleHttpRequest *request,
+	const gchar *block);
+
 
 /**************************************************************************/
 /* HTTP Keep-Alive pool API                                               */
@@ -835,6 +885,63 @@ purple_http_keepalive_pool_set_limit_per_host(PurpleHttpKeepalivePool *pool,
 guint
 purple_http_keepalive_pool_get_limit_per_host(PurpleHttpKeepalivePool *pool);
 
+/**
+ * purple_http_keepalive_pool_set_idle_timeout:
+ * @pool:    The HTTP Keep-Alive pool.
+ * @seconds: The timeout, 0 for unlimited.
+ *
+ * Sets for how long an unused connection may be kept for reuse. Connections
+ * idle for longer are closed, as the server has most likely dropped them
+ * already.
+ */
+void
+purple_http_keepalive_pool_set_idle_timeout(PurpleHttpKeepalivePool *pool,
+	guint seconds);
+
+/**
+ * purple_http_keepalive_pool_get_idle_timeout:
+ * @pool: The HTTP Keep-Alive pool.
+ *
+ * Gets for how long an unused connection may be kept for reuse.
+ *
+ * Returns: The timeout in seconds, 0 for unlimited.
+ */
+guint
+purple_http_keepalive_pool_get_idle_timeout(PurpleHttpKeepalivePool *pool);
+
+/**
+ * purple_http_keepalive_pool_set_pipelining:
+ * @pool:  The HTTP Keep-Alive pool.
+ * @host:  The hostname.
+ * @depth: The maximum number of requests in flight on one connection, 0 or 1
+ *         to disable pipelining.
+ *
+ * Allows HTTP/1.1 pipelining of GET requests to the given host. A request is
+ * only pipelined when all connections to the host are busy and no more may
+ * be opened. If the server closes a connection before answering all of its
+ * requests, the rest are sent again on another one.
+ */
+void
+purple_http_keepalive_pool_set_pipelining(PurpleHttpKeepalivePool *pool,
+	const gchar *host, guint depth);
+
+/**
+ * purple_http_keepalive_pool_prewarm:
+ * @pool:   The HTTP Keep-Alive pool.
+ * @gc:     The connection, used for proxy settings (may be %NULL).
+ * @host:   The hostname.
+ * @port:   The port, 0 for the scheme default.
+ * @is_ssl: %TRUE for a TLS connection.
+ *
+ * Opens a connection to the given host ahead of time and leaves it idle in
+ * the pool, so a request issued later can reuse it instead of waiting for
+ * name resolution and the TCP/TLS handshakes. Does nothing if the pool
+ * already has (or is opening) a connection to that host.
+ */
+void
+purple_http_keepalive_pool_prewarm(PurpleHttpKeepalivePool *pool,
+	PurpleConnection *gc, const gchar *host, int port, gboolean is_ssl);
+
 
 /**************************************************************************/
 /* HTTP connection set API                                                */
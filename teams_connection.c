@@ -20,59 +20,958 @@
 
 #include "http.h"
 
+/*
+ * Incremental splitter for responses shaped like {"...": ..., "member": [ {..}, {..} ], ...}
+ *
+ * Each element of the named top-level array is handed to element_callback as soon as
+ * its closing bracket arrives, then thrown away.  Everything else in the document is
+ * copied into a small skeleton (with the array left empty) which is parsed as normal
+ * once the response is complete.
+ */
+struct _TeamsJsonStream {
+	gchar *array_member;
+	TeamsProxyCallbackFunc element_callback;
+	
+	JsonParser *parser;
+	GString *skeleton;
+	GString *element;
+	GString *key;
+	
+	guint depth;
+	gboolean in_string;
+	gboolean escaped;
+	gboolean in_array;
+	gboolean in_element;
+};
+
+static TeamsJsonStream *
+teams_json_stream_new(const gchar *array_member, TeamsProxyCallbackFunc element_callback)
+{
+	TeamsJsonStream *stream = g_new0(TeamsJsonStream, 1);
+	
+	stream->array_member = g_strdup(array_member);
+	stream->element_callback = element_callback;
+	stream->parser = json_parser_new();
+	stream->skeleton = g_string_new(NULL);
+	stream->element = g_string_new(NULL);
+	stream->key = g_string_new(NULL);
+	
+	return stream;
+}
+
+static void
+teams_json_stream_free(TeamsJsonStream *stream)
+{
+	if (stream == NULL)
+		return;
+	
+	g_object_unref(stream->parser);
+	g_string_free(stream->skeleton, TRUE);
+	g_string_free(stream->element, TRUE);
+	g_string_free(stream->key, TRUE);
+	g_free(stream->array_member);
+	g_free(stream);
+}
+
+static void
+teams_json_stream_emit(TeamsConnection *conn)
+{
+	TeamsJsonStream *stream = conn->stream;
+	
+	stream->in_element = FALSE;
+	
+	if (json_parser_load_from_data(stream->parser, stream->element->str, stream->element->len, NULL)) {
+		stream->element_callback(conn->sa, json_parser_get_root(stream->parser), conn->user_data);
+	} else {
+		purple_debug_error("teams", "Error parsing %s element: %s\n", stream->array_member, stream->element->str);
+	}
+	
+	g_string_truncate(stream->element, 0);
+}
+
+static gboolean
+teams_json_stream_write(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, const gchar *buffer, size_t offset, size_t length, gpointer user_data)
+{
+	TeamsConnection *conn = user_data;
+	TeamsJsonStream *stream = conn->stream;
+	const gchar *end = buffer + length;
+	const gchar *c;
+	
+	for (c = buffer; c < end; c++) {
+		GString *sink;
+		
+		if (stream->in_element) {
+			sink = stream->element;
+		} else if (stream->in_array && stream->depth == 2) {
+			sink = NULL;
+		} else {
+			sink = stream->skeleton;
+		}
+		
+		if (stream->in_string) {
+			if (sink != NULL)
+				g_string_append_c(sink, *c);
+			
+			if (stream->escaped) {
+				stream->escaped = FALSE;
+			} else if (*c == '\\') {
+				stream->escaped = TRUE;
+			} else if (*c == '"') {
+				stream->in_string = FALSE;
+				continue;
+			}
+			
+			if (stream->depth == 1)
+				g_string_append_c(stream->key, *c);
+			continue;
+		}
+		
+		switch (*c) {
+			case '"':
+				if (stream->depth == 1)
+					g_string_truncate(stream->key, 0);
+				if (stream->in_array && stream->depth == 2 && !stream->in_element) {
+					stream->in_element = TRUE;
+					sink = stream->element;
+				}
+				stream->in_string = TRUE;
+				if (sink != NULL)
+					g_string_append_c(sink, *c);
+				break;
+			
+			case '{':
+			case '[':
+				if (*c == '[' && !stream->in_array && stream->depth == 1 &&
+						purple_strequal(stream->key->str, stream->array_member)) {
+					stream->in_array = TRUE;
+				} else if (stream->in_array && stream->depth == 2 && !stream->in_element) {
+					stream->in_element = TRUE;
+					sink = stream->element;
+				}
+				stream->depth++;
+				if (sink != NULL)
+					g_string_append_c(sink, *c);
+				break;
+			
+			case '}':
+			case ']':
+				if (stream->depth == 0) {
+					purple_debug_error("teams", "Unbalanced JSON in streamed response\n");
+					return FALSE;
+				}
+				
+				if (stream->in_array && stream->depth == 2) {
+					// The end of the streamed array; flush any trailing scalar element
+					if (stream->in_element)
+						teams_json_stream_emit(conn);
+					stream->in_array = FALSE;
+					sink = stream->skeleton;
+				}
+				stream->depth--;
+				if (sink != NULL)
+					g_string_append_c(sink, *c);
+				
+				if (stream->in_element && stream->depth == 2)
+					teams_json_stream_emit(conn);
+				break;
+			
+			case ',':
+				if (stream->in_element && stream->depth == 2) {
+					teams_json_stream_emit(conn);
+				} else if (sink != NULL) {
+					g_string_append_c(sink, *c);
+				}
+				break;
+			
+			case ' ': case '\t': case '\r': case '\n':
+				if (sink != NULL)
+					g_string_append_c(sink, *c);
+				break;
+			
+			default:
+				if (stream->in_array && stream->depth == 2 && !stream->in_element) {
+					stream->in_element = TRUE;
+					sink = stream->element;
+				}
+				if (sink != NULL)
+					g_string_append_c(sink, *c);
+				break;
+		}
+	}
+	
+	return TRUE;
+}
+
 static void
 teams_destroy_connection(TeamsConnection *conn)
 {
+	if (conn->retry_timeout) {
+		g_source_remove(conn->retry_timeout);
+	}
+	if (conn->request != NULL) {
+		purple_http_request_unref(conn->request);
+	}
+	g_free(conn->host);
+	teams_json_stream_free(conn->stream);
+	g_free(conn->inflight_key);
+	g_free(conn->validator_key);
 	g_free(conn->url);
 	g_free(conn);
 }
 
+/*
+ * Validators are keyed on the URL without its query, so that windowed views
+ * (the calendar) can still be revalidated by ETag; Last-Modified is only sent
+ * back for the exact URL it came from.
+ */
+typedef struct {
+	gchar *url;
+	gchar *etag;
+	gchar *last_modified;
+} TeamsValidator;
+
+static void
+teams_validator_free(TeamsValidator *validator)
+{
+	g_free(validator->url);
+	g_free(validator->etag);
+	g_free(validator->last_modified);
+	g_free(validator);
+}
+
+static gchar *
+teams_request_key(TeamsMethod method, const gchar *url, gsize url_len, const gchar *postdata)
+{
+	gchar *checksum = postdata ? g_compute_checksum_for_string(G_CHECKSUM_SHA1, postdata, -1) : NULL;
+	gchar *key;
+	
+	key = g_strdup_printf("%x %.*s %s", method & (TEAMS_METHOD_POST | TEAMS_METHOD_PUT | TEAMS_METHOD_DELETE | TEAMS_METHOD_CONDITIONAL), (int) url_len, url, checksum ? checksum : "");
+	g_free(checksum);
+	
+	return key;
+}
+
+static void
+teams_validator_update(TeamsAccount *sa, const gchar *key, const gchar *url, PurpleHttpResponse *response)
+{
+	const gchar *etag = purple_http_response_get_header(response, "ETag");
+	const gchar *last_modified = purple_http_response_get_header(response, "Last-Modified");
+	TeamsValidator *validator;
+	
+	if (etag == NULL && last_modified == NULL) {
+		if (sa->validators != NULL) {
+			g_hash_table_remove(sa->validators, key);
+		}
+		return;
+	}
+	
+	if (sa->validators == NULL) {
+		sa->validators = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) teams_validator_free);
+	}
+	validator = g_new0(TeamsValidator, 1);
+	validator->url = g_strdup(url);
+	validator->etag = g_strdup(etag);
+	validator->last_modified = g_strdup(last_modified);
+	g_hash_table_replace(sa->validators, g_strdup(key), validator);
+}
+
+static void
+teams_validator_apply(TeamsAccount *sa, PurpleHttpRequest *request, const gchar *key, const gchar *url)
+{
+	TeamsValidator *validator = sa->validators ? g_hash_table_lookup(sa->validators, key) : NULL;
+	
+	if (validator == NULL) {
+		return;
+	}
+	if (validator->etag != NULL) {
+		purple_http_request_header_set(request, "If-None-Match", validator->etag);
+	}
+	if (validator->last_modified != NULL && g_str_equal(validator->url, url)) {
+		purple_http_request_header_set(request, "If-Modified-Since", validator->last_modified);
+	}
+}
+
+static gboolean teams_connection_send(TeamsConnection *conn);
+static gboolean teams_connection_retry(TeamsConnection *conn, PurpleHttpResponse *response);
+
 static void
 teams_post_or_get_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
 	TeamsConnection *conn = user_data;
-	const gchar *data;
-	gsize len;
+	const gchar *data = NULL;
+	gsize len = 0;
+	GSList *conns, *it;
+	JsonParser *parser = NULL;
+	gboolean parsed = FALSE;
+	JsonNode *not_modified = NULL;
+	
+	if (response != NULL && teams_connection_retry(conn, response)) {
+		// Sent again later; this http_conn is freed once we return
+		conn->http_conn = NULL;
+		return;
+	}
+	
+	if (conn->inflight_key != NULL && conn->sa->inflight_requests != NULL) {
+		// Anything asked for from here on needs a fresh response
+		g_hash_table_remove(conn->sa->inflight_requests, conn->inflight_key);
+	}
+	conns = g_slist_prepend(g_slist_reverse(conn->followers), conn);
+	conn->followers = NULL;
+	
+	if (conn->stream != NULL) {
+		// The streamed elements have already been dispatched, only the leftovers remain
+		data = conn->stream->skeleton->str;
+		len = conn->stream->skeleton->len;
+	} else if (response != NULL) {
+		data = purple_http_response_get_data(response, &len);
+	}
 	
-	data = purple_http_response_get_data(response, &len);
+	if (conn->validator_key != NULL && response != NULL && purple_http_response_get_code(response) == 304) {
+		purple_debug_info("teams", "Not modified: %s\n", conn->url);
+		not_modified = json_node_new(JSON_NODE_NULL);
+	}
 	
-	if (conn->callback != NULL) {
+	for (it = conns; it != NULL; it = it->next) {
+		TeamsConnection *waiting = it->data;
+		
+		if (waiting->callback == NULL) {
+			continue;
+		}
+		if (not_modified != NULL) {
+			waiting->callback(waiting->sa, not_modified, waiting->user_data);
+			continue;
+		}
 		if (!len)
 		{
 			purple_debug_info("teams", "No data in response\n");
-			conn->callback(conn->sa, NULL, conn->user_data);
-		} else {
-			JsonParser *parser = json_parser_new();
-			if (!json_parser_load_from_data(parser, data, len, NULL))
-			{
-				if (conn->error_callback != NULL) {
-					conn->error_callback(conn->sa, data, len, conn->user_data);
-				} else {
-					purple_debug_error("teams", "Error parsing response: %s\n", data);
-				}
+			waiting->callback(waiting->sa, NULL, waiting->user_data);
+			continue;
+		}
+		
+		if (parser == NULL) {
+			parser = json_parser_new();
+			parsed = json_parser_load_from_data(parser, data, len, NULL);
+		}
+		if (!parsed)
+		{
+			if (waiting->error_callback != NULL) {
+				waiting->error_callback(waiting->sa, data, len, waiting->user_data);
 			} else {
-				JsonNode *root = json_parser_get_root(parser);
-				
-				purple_debug_info("teams", "executing callback for %s\n", conn->url);
-				conn->callback(conn->sa, root, conn->user_data);
+				purple_debug_error("teams", "Error parsing response: %s\n", data);
 			}
-			g_object_unref(parser);
+		} else {
+			JsonNode *root = json_parser_get_root(parser);
+			
+			purple_debug_info("teams", "executing callback for %s\n", waiting->url);
+			waiting->callback(waiting->sa, root, waiting->user_data);
 		}
 	}
 	
-	teams_destroy_connection(conn);
+	// Only remember validators for responses that were actually taken in
+	if (conn->validator_key != NULL && parsed && purple_http_response_is_successful(response)) {
+		teams_validator_update(conn->sa, conn->validator_key, conn->url, response);
+	}
+	
+	if (not_modified != NULL) {
+		json_node_free(not_modified);
+	}
+	if (parser != NULL) {
+		g_object_unref(parser);
+	}
+	g_slist_free_full(conns, (GDestroyNotify) teams_destroy_connection);
 }
 
-TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
+static void teams_host_profile_apply(TeamsAccount *sa, PurpleHttpRequest *request, const gchar *host, const gchar *url);
+
+/*
+ * Outbound requests are smoothed with a token bucket per host, sized by the
+ * rate_limit_per_second and rate_limit_burst account options.  Requests that find the
+ * bucket empty, or the host throttled, wait their turn in a queue on the bucket, with
+ * a single timer for whoever is at the front.  Interactive requests skip the queue and
+ * take a token at once, leaving the bucket in debt so the backfill goes a little later;
+ * the debt is capped at one burst so a flurry of them can't push it minutes out.
+ */
+typedef struct {
+	TeamsAccount *sa;
+	const gchar *host; // the table's key
+	gdouble tokens;
+	gint64 updated;
+	GQueue waiting;
+	guint timeout;
+} TeamsTokenBucket;
+
+static void
+teams_token_bucket_free(TeamsTokenBucket *bucket)
+{
+	if (bucket->timeout) {
+		g_source_remove(bucket->timeout);
+	}
+	g_queue_clear(&bucket->waiting);
+	g_free(bucket);
+}
+
+static void
+teams_token_bucket_refill(TeamsTokenBucket *bucket)
+{
+	TeamsAccount *sa = bucket->sa;
+	gint rate = purple_account_get_int(sa->account, "rate_limit_per_second", TEAMS_DEFAULT_RATE_LIMIT);
+	gint burst = MAX(1, purple_account_get_int(sa->account, "rate_limit_burst", TEAMS_DEFAULT_RATE_BURST));
+	gint64 now = g_get_monotonic_time();
+	
+	if (rate > 0) {
+		bucket->tokens = MIN(burst, bucket->tokens + (gdouble) (now - bucket->updated) * rate / G_USEC_PER_SEC);
+	}
+	bucket->updated = now;
+}
+
+static TeamsTokenBucket *
+teams_token_bucket_get(TeamsAccount *sa, const gchar *host)
+{
+	TeamsTokenBucket *bucket;
+	gchar *key;
+	
+	if (sa->host_buckets == NULL) {
+		sa->host_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) teams_token_bucket_free);
+	}
+	bucket = g_hash_table_lookup(sa->host_buckets, host);
+	if (bucket == NULL) {
+		key = g_strdup(host);
+		bucket = g_new0(TeamsTokenBucket, 1);
+		bucket->sa = sa;
+		bucket->host = key;
+		bucket->tokens = MAX(1, purple_account_get_int(sa->account, "rate_limit_burst", TEAMS_DEFAULT_RATE_BURST));
+		bucket->updated = g_get_monotonic_time();
+		g_queue_init(&bucket->waiting);
+		g_hash_table_insert(sa->host_buckets, key, bucket);
+	}
+	teams_token_bucket_refill(bucket);
+	
+	return bucket;
+}
+
+// How many milliseconds until a request may go, 0 for straight away
+static guint
+teams_token_bucket_wait(TeamsTokenBucket *bucket, gboolean interactive)
+{
+	TeamsAccount *sa = bucket->sa;
+	gint rate = purple_account_get_int(sa->account, "rate_limit_per_second", TEAMS_DEFAULT_RATE_LIMIT);
+	
+	if (sa->host_throttle != NULL) {
+		gint64 *until = g_hash_table_lookup(sa->host_throttle, bucket->host);
+		gint64 now = time(NULL);
+		
+		if (until != NULL && *until > now) {
+			return (*until - now) * 1000;
+		}
+	}
+	
+	if (interactive || rate <= 0 || bucket->tokens >= 1) {
+		return 0;
+	}
+	return (guint) ((1 - bucket->tokens) * 1000 / rate) + 1;
+}
+
+static void
+teams_token_bucket_take(TeamsTokenBucket *bucket)
+{
+	gint burst = MAX(1, purple_account_get_int(bucket->sa->account, "rate_limit_burst", TEAMS_DEFAULT_RATE_BURST));
+	
+	bucket->tokens = MAX(bucket->tokens - 1, -burst);
+}
+
+static gboolean teams_token_bucket_drain_cb(gpointer user_data);
+
+static void
+teams_token_bucket_schedule(TeamsTokenBucket *bucket)
+{
+	TeamsConnection *head = g_queue_peek_head(&bucket->waiting);
+	
+	if (bucket->timeout) {
+		g_source_remove(bucket->timeout);
+		bucket->timeout = 0;
+	}
+	if (head != NULL) {
+		bucket->timeout = g_timeout_add(teams_token_bucket_wait(bucket, head->interactive), teams_token_bucket_drain_cb, bucket);
+	}
+}
+
+static void
+teams_token_bucket_enqueue(TeamsTokenBucket *bucket, TeamsConnection *conn)
+{
+	TeamsAccount *sa = bucket->sa;
+	GList *it = bucket->waiting.head;
+	
+	if (sa->deferred_requests == NULL) {
+		sa->deferred_requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	g_hash_table_insert(sa->deferred_requests, conn, conn);
+	
+	// Interactive requests only wait out throttling, so they go ahead of the backfill
+	if (conn->interactive) {
+		while (it != NULL && ((TeamsConnection *) it->data)->interactive) {
+			it = it->next;
+		}
+	} else {
+		it = NULL;
+	}
+	if (it != NULL) {
+		g_queue_insert_before(&bucket->waiting, it, conn);
+	} else {
+		g_queue_push_tail(&bucket->waiting, conn);
+	}
+	
+	// A new front of the queue may be due sooner
+	if (bucket->timeout == 0 || g_queue_peek_head(&bucket->waiting) == conn) {
+		teams_token_bucket_schedule(bucket);
+	}
+}
+
+static gboolean
+teams_connection_dispatch(TeamsConnection *conn)
+{
+	TeamsAccount *sa = conn->sa;
+	
+	conn->http_conn = purple_http_request(sa->pc, conn->request, teams_post_or_get_cb, conn);
+	if (conn->http_conn == NULL) {
+		return FALSE;
+	}
+	purple_http_connection_set_add(sa->conns, conn->http_conn);
+	
+	return TRUE;
+}
+
+static gboolean
+teams_token_bucket_drain_cb(gpointer user_data)
+{
+	TeamsTokenBucket *bucket = user_data;
+	TeamsAccount *sa = bucket->sa;
+	TeamsConnection *conn;
+	
+	bucket->timeout = 0;
+	teams_token_bucket_refill(bucket);
+	
+	while ((conn = g_queue_peek_head(&bucket->waiting)) != NULL && teams_token_bucket_wait(bucket, conn->interactive) == 0) {
+		g_queue_pop_head(&bucket->waiting);
+		g_hash_table_remove(sa->deferred_requests, conn);
+		teams_token_bucket_take(bucket);
+		
+		// The tokens may have been refreshed while this waited
+		teams_host_profile_apply(sa, conn->request, conn->host, conn->path);
+		if (!teams_connection_dispatch(conn)) {
+			teams_post_or_get_cb(NULL, NULL, conn);
+		}
+	}
+	
+	if (bucket->timeout == 0) {
+		teams_token_bucket_schedule(bucket);
+	}
+	
+	return FALSE;
+}
+
+static gboolean
+teams_connection_send(TeamsConnection *conn)
+{
+	TeamsTokenBucket *bucket = teams_token_bucket_get(conn->sa, conn->host);
+	
+	// Streams (the long-poll) still count against the host, but never wait
+	if (conn->stream == NULL) {
+		if ((!conn->interactive && !g_queue_is_empty(&bucket->waiting)) || teams_token_bucket_wait(bucket, conn->interactive) > 0) {
+			teams_token_bucket_enqueue(bucket, conn);
+			return TRUE;
+		}
+	}
+	teams_token_bucket_take(bucket);
+	
+	return teams_connection_dispatch(conn);
+}
+
+/*
+ * Throttling (429/503) is retried whatever the method, as the request wasn't acted
+ * on, and makes everything else headed to that host wait as well.  Gateway errors
+ * and dropped connections are only retried when the request is safe to repeat.
+ * Streamed requests are left alone: they may have handed out elements already, and
+ * the long-poll has its own backoff.
+ */
+static gboolean
+teams_connection_retry_cb(gpointer user_data)
+{
+	TeamsConnection *conn = user_data;
+	TeamsAccount *sa = conn->sa;
+	
+	conn->retry_timeout = 0;
+	g_hash_table_remove(sa->deferred_requests, conn);
+	
+	// The tokens may have been refreshed while this waited
+	teams_host_profile_apply(sa, conn->request, conn->host, conn->path);
+	
+	if (!teams_connection_send(conn)) {
+		teams_post_or_get_cb(NULL, NULL, conn);
+	}
+	
+	return FALSE;
+}
+
+static void
+teams_connection_defer(TeamsConnection *conn, guint ms)
+{
+	TeamsAccount *sa = conn->sa;
+	
+	if (sa->deferred_requests == NULL) {
+		sa->deferred_requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	g_hash_table_insert(sa->deferred_requests, conn, conn);
+	conn->retry_timeout = g_timeout_add(ms, teams_connection_retry_cb, conn);
+}
+
+static gboolean
+teams_connection_retry(TeamsConnection *conn, PurpleHttpResponse *response)
+{
+	TeamsAccount *sa = conn->sa;
+	int code = purple_http_response_get_code(response);
+	const gchar *retry_after;
+	gboolean throttled = (code == 429 || code == 503);
+	guint delay;
+	
+	if (conn->stream != NULL || conn->request == NULL) {
+		return FALSE;
+	}
+	// Cancelled connections have neither a status nor an error
+	if (!throttled && !(conn->idempotent && (code == 502 || code == 504 ||
+			(code == 0 && purple_http_response_get_error(response) != NULL)))) {
+		return FALSE;
+	}
+	if (conn->attempts >= TEAMS_MAX_MSG_RETRY) {
+		return FALSE;
+	}
+	
+	// Decorrelated jitter: anywhere between the base and three times the last delay
+	delay = g_random_int_range(TEAMS_RETRY_BASE_SECONDS, MAX(TEAMS_RETRY_BASE_SECONDS, conn->retry_delay * 3) + 1);
+	delay = MIN(delay, TEAMS_RETRY_MAX_SECONDS);
+	
+	retry_after = purple_http_response_get_header(response, "Retry-After");
+	if (retry_after != NULL && g_ascii_isdigit(*retry_after)) {
+		guint64 seconds = g_ascii_strtoull(retry_after, NULL, 10);
+		
+		if (seconds > TEAMS_RETRY_AFTER_MAX_SECONDS) {
+			purple_debug_warning("teams", "Giving up on %s, asked to retry after %s seconds\n", conn->url, retry_after);
+			return FALSE;
+		}
+		delay = MAX(delay, (guint) seconds);
+	}
+	
+	if (throttled) {
+		gint64 *until;
+		
+		if (sa->host_throttle == NULL) {
+			sa->host_throttle = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		}
+		until = g_hash_table_lookup(sa->host_throttle, conn->host);
+		if (until == NULL) {
+			until = g_new0(gint64, 1);
+			g_hash_table_insert(sa->host_throttle, g_strdup(conn->host), until);
+		}
+		*until = MAX(*until, (gint64) time(NULL) + delay);
+	}
+	
+	conn->attempts++;
+	conn->retry_delay = delay;
+	purple_debug_info("teams", "HTTP %d for %s, retrying in %u seconds\n", code, conn->url, delay);
+	teams_connection_defer(conn, delay * 1000);
+	
+	return TRUE;
+}
+
+void
+teams_post_or_get_cancel_deferred(TeamsAccount *sa)
+{
+	GHashTable *deferred = sa->deferred_requests;
+	GHashTableIter iter;
+	gpointer key;
+	GSList *conns = NULL;
+	
+	if (sa->host_buckets != NULL) {
+		TeamsTokenBucket *bucket;
+		
+		g_hash_table_iter_init(&iter, sa->host_buckets);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &bucket)) {
+			g_queue_clear(&bucket->waiting);
+			teams_token_bucket_schedule(bucket);
+		}
+	}
+	
+	if (deferred == NULL) {
+		return;
+	}
+	sa->deferred_requests = NULL;
+	
+	g_hash_table_iter_init(&iter, deferred);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		conns = g_slist_prepend(conns, key);
+	}
+	g_hash_table_destroy(deferred);
+	
+	while (conns != NULL) {
+		TeamsConnection *conn = conns->data;
+		
+		// Those waiting on their host's bucket have no timer of their own
+		if (conn->retry_timeout) {
+			g_source_remove(conn->retry_timeout);
+			conn->retry_timeout = 0;
+		}
+		teams_post_or_get_cb(NULL, NULL, conn);
+		conns = g_slist_delete_link(conns, conns);
+	}
+}
+
+void
+teams_prewarm_connections(TeamsAccount *sa)
+{
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	// The first requests after authenticating go to these
+	const gchar *hosts[] = {
+		TEAMS_BASE_ORIGIN_HOST,
+		sa->messages_host,
+		TEAMS_CONTACTS_HOST,
+		TEAMS_PRESENCE_HOST,
+	};
+	guint i;
+	
+	for (i = 0; i < G_N_ELEMENTS(hosts); i++) {
+		if (hosts[i] != NULL) {
+			purple_http_keepalive_pool_prewarm(sa->keepalive_pool, sa->pc, hosts[i], 443, TRUE);
+		}
+	}
+#endif
+}
+
+/*
+ * Headers that only depend on the destination host and the account's tokens are
+ * worked out once per host and kept pre-formatted.  The table is thrown away by
+ * teams_host_profiles_invalidate() whenever one of the inputs changes, and rebuilt
+ * on the next request.
+ */
+typedef struct {
+	const gchar *accept;
+	gboolean cookies;
+	GPtrArray *headers; // name, value, name, value, ...
+	gchar *block;
+} TeamsHostProfile;
+
+static void
+teams_host_profile_free(TeamsHostProfile *profile)
+{
+	g_ptr_array_free(profile->headers, TRUE);
+	g_free(profile->block);
+	g_free(profile);
+}
+
+static void
+teams_host_profile_add(TeamsHostProfile *profile, const gchar *name, const gchar *value)
+{
+	if (value == NULL) {
+		return;
+	}
+	g_ptr_array_add(profile->headers, g_strdup(name));
+	g_ptr_array_add(profile->headers, g_strdup(value));
+}
+
+static void
+teams_host_profile_add_printf(TeamsHostProfile *profile, const gchar *name, const gchar *format, const gchar *value)
+{
+	gchar *formatted;
+	
+	if (value == NULL) {
+		return;
+	}
+	formatted = g_strdup_printf(format, value);
+	g_ptr_array_add(profile->headers, g_strdup(name));
+	g_ptr_array_add(profile->headers, formatted);
+}
+
+static TeamsHostProfile *
+teams_host_profile_new(const gchar *accept)
+{
+	TeamsHostProfile *profile = g_new0(TeamsHostProfile, 1);
+	
+	profile->accept = accept;
+	profile->headers = g_ptr_array_new_with_free_func(g_free);
+	
+	teams_host_profile_add(profile, "BehaviorOverride", "redirectAs404");
+#ifdef ENABLE_TEAMS_PERSONAL
+	teams_host_profile_add(profile, "X-MS-Client-Consumer-Type", "teams4life");
+#endif
+	
+	return profile;
+}
+
+static const gchar *
+teams_accept_language(void)
+{
+	static gchar *language_names = NULL;
+	
+	/* Tell the server what language we accept, so that we get error messages in our language (rather than our IP's) */
+	if (language_names == NULL) {
+		const gchar* const *languages = g_get_language_names();
+		language_names = g_strjoinv(", ", (gchar **)languages);
+		purple_util_chrreplace(language_names, '_', '-');
+	}
+	
+	return language_names;
+}
+
+static void
+teams_host_profile_finish(GHashTable *profiles, const gchar *host, TeamsHostProfile *profile)
+{
+	GString *block = g_string_new(NULL);
+	guint i;
+	
+	teams_host_profile_add(profile, "Accept-Language", teams_accept_language());
+	
+	for (i = 0; i + 1 < profile->headers->len; i += 2) {
+		g_string_append_printf(block, "%s: %s\r\n",
+			(gchar *) g_ptr_array_index(profile->headers, i),
+			(gchar *) g_ptr_array_index(profile->headers, i + 1));
+	}
+	profile->block = g_string_free(block, FALSE);
+	
+	g_hash_table_replace(profiles, g_strdup(host), profile);
+}
+
+static GHashTable *
+teams_host_profiles_build(TeamsAccount *sa)
+{
+	GHashTable *profiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) teams_host_profile_free);
+	const gchar *contacts_hosts[] = { TEAMS_CONTACTS_HOST, TEAMS_VIDEOMAIL_HOST, TEAMS_NEW_CONTACTS_HOST };
+	TeamsHostProfile *profile;
+	guint i;
+	
+	// Fallback for hosts not listed here; keyed on "" so it can live in the same table
+	profile = teams_host_profile_new("*/*");
+	profile->cookies = TRUE;
+	teams_host_profile_finish(profiles, "", profile);
+	
+	// Added before the fixed hosts so they win if the messages host ever matches one
+	if (sa->messages_host != NULL) {
+		profile = teams_host_profile_new("application/json; ver=1.0");
+		teams_host_profile_add_printf(profile, "Authentication", "skypetoken=%s", sa->skype_token);
+		teams_host_profile_add(profile, "Referer", "https://" TEAMS_BASE_ORIGIN_HOST "/");
+		teams_host_profile_add(profile, "ClientInfo", "os=windows; osVer=10; proc=x86; lcid=en-us; deviceType=1; country=n/a; clientName=" TEAMS_CLIENTINFO_NAME "; clientVer=" TEAMS_CLIENTINFO_VERSION);
+		teams_host_profile_finish(profiles, sa->messages_host, profile);
+	}
+	
+	for (i = 0; i < G_N_ELEMENTS(contacts_hosts); i++) {
+		profile = teams_host_profile_new("application/json; ver=1.0;");
+		teams_host_profile_add(profile, "X-Skypetoken", sa->skype_token);
+		teams_host_profile_add(profile, "X-Stratus-Caller", TEAMS_CLIENTINFO_NAME);
+		teams_host_profile_add(profile, "X-Stratus-Request", "abcd1234");
+		teams_host_profile_add(profile, "Origin", "https://" TEAMS_BASE_ORIGIN_HOST);
+		teams_host_profile_add(profile, "Referer", "https://" TEAMS_BASE_ORIGIN_HOST "/");
+		teams_host_profile_finish(profiles, contacts_hosts[i], profile);
+	}
+	
+	profile = teams_host_profile_new("application/json");
+	teams_host_profile_add(profile, "X-Skypetoken", sa->skype_token);
+	teams_host_profile_finish(profiles, TEAMS_GRAPH_HOST, profile);
+	
+	profile = teams_host_profile_new("application/json");
+	teams_host_profile_add(profile, "X-RecommenderServiceSettings", "{\"experiment\":\"default\",\"recommend\":\"true\"}");
+	teams_host_profile_add(profile, "X-ECS-ETag", TEAMS_CLIENTINFO_NAME);
+	teams_host_profile_add(profile, "X-Skypetoken", sa->skype_token);
+	teams_host_profile_add(profile, "X-Skype-Client", TEAMS_CLIENTINFO_VERSION);
+	teams_host_profile_finish(profiles, TEAMS_DEFAULT_CONTACT_SUGGESTIONS_HOST, profile);
+	
+	profile = teams_host_profile_new("application/json");
+	if (sa->presence_access_token != NULL) {
+		teams_host_profile_add_printf(profile, "Authorization", "Bearer %s", sa->presence_access_token);
+	} else {
+		teams_host_profile_add(profile, "X-Skypetoken", sa->skype_token);
+	}
+	teams_host_profile_add(profile, "x-ms-client-user-agent", "Teams-Desktop");
+	teams_host_profile_add(profile, "x-ms-correlation-id", "1");
+	teams_host_profile_add(profile, "x-ms-client-version", "27/1.0.0.2023052414");
+	teams_host_profile_add(profile, "x-ms-endpoint-id", sa->endpoint);
+	teams_host_profile_finish(profiles, TEAMS_PRESENCE_HOST, profile);
+	
+	profile = teams_host_profile_new("application/json");
+	teams_host_profile_add_printf(profile, "Authorization", "Bearer %s", sa->substrate_access_token);
+#ifdef ENABLE_TEAMS_PERSONAL
+	teams_host_profile_add(profile, "X-AnchorMailbox", sa->username);
+#endif
+	teams_host_profile_finish(profiles, "substrate.office.com", profile);
+	
+	// Authorization depends on the path, so that one is added per request
+	profile = teams_host_profile_new("application/json");
+	teams_host_profile_add(profile, "X-Skypetoken", sa->skype_token);
+	teams_host_profile_finish(profiles, TEAMS_BASE_ORIGIN_HOST, profile);
+	
+	return profiles;
+}
+
+void
+teams_host_profiles_invalidate(TeamsAccount *sa)
+{
+	if (sa->host_profiles != NULL) {
+		g_hash_table_destroy(sa->host_profiles);
+		sa->host_profiles = NULL;
+	}
+}
+
+static void
+teams_host_profile_apply(TeamsAccount *sa, PurpleHttpRequest *request, const gchar *host, const gchar *url)
+{
+	TeamsHostProfile *profile;
+	
+	if (sa->host_profiles == NULL) {
+		sa->host_profiles = teams_host_profiles_build(sa);
+	}
+	
+	profile = g_hash_table_lookup(sa->host_profiles, host);
+	if (profile == NULL) {
+		profile = g_hash_table_lookup(sa->host_profiles, "");
+	}
+	
+	purple_http_request_header_set(request, "Accept", profile->accept);
+	if (profile->cookies) {
+		purple_http_request_set_cookie_jar(request, sa->cookie_jar);
+	}
+	
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	purple_http_request_set_header_block(request, profile->block);
+#else
+	{
+		guint i;
+		for (i = 0; i + 1 < profile->headers->len; i += 2) {
+			purple_http_request_header_set(request, g_ptr_array_index(profile->headers, i), g_ptr_array_index(profile->headers, i + 1));
+		}
+	}
+#endif
+	
+	if (g_str_equal(host, TEAMS_BASE_ORIGIN_HOST)) { // maybe chatsvcagg.teams.microsoft.com too?
+#ifdef ENABLE_TEAMS_PERSONAL
+		if (strstr(url, "/api/csa/") == url) {
+#else
+		if (strstr(url, "/api/csa/") == url && sa->csa_access_token != NULL) {
+			purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->csa_access_token);
+#endif
+		} else {
+			purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->id_token);
+		}
+	}
+}
+
+static TeamsConnection *
+teams_post_or_get_full(TeamsAccount *sa, TeamsMethod method,
 		const gchar *host, const gchar *url, const gchar *postdata,
+		const gchar *array_member, TeamsProxyCallbackFunc element_func,
 		TeamsProxyCallbackFunc callback_func, gpointer user_data,
 		gboolean keepalive)
 {
 	TeamsConnection *conn;
 	PurpleHttpRequest *request;
-	const gchar* const *languages;
-	gchar *language_names;
 	gchar *real_url;
+	gchar *inflight_key = NULL;
+	gchar *validator_key = NULL;
 	
 	g_return_val_if_fail(host != NULL, NULL);
 	g_return_val_if_fail(url != NULL, NULL);
@@ -80,6 +979,28 @@ TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
 	
 	real_url = g_strdup_printf("%s://%s%s", method & TEAMS_METHOD_SSL ? "https" : "http", host, url);
 	
+	// Bursts of events tend to ask for the same thing several times over;
+	// let the repeats share the response of the request already on the wire
+	if (array_member == NULL && (method & TEAMS_METHOD_COALESCE || !(method & (TEAMS_METHOD_POST | TEAMS_METHOD_PUT | TEAMS_METHOD_DELETE)))) {
+		TeamsConnection *leader;
+		
+		inflight_key = teams_request_key(method, real_url, strlen(real_url), postdata);
+		leader = sa->inflight_requests ? g_hash_table_lookup(sa->inflight_requests, inflight_key) : NULL;
+		if (leader != NULL) {
+			purple_debug_info("teams", "Joining in-flight request for %s\n", real_url);
+			g_free(inflight_key);
+			
+			conn = g_new0(TeamsConnection, 1);
+			conn->sa = sa;
+			conn->user_data = user_data;
+			conn->url = real_url;
+			conn->callback = callback_func;
+			leader->followers = g_slist_prepend(leader->followers, conn);
+			
+			return conn;
+		}
+	}
+	
 	purple_debug_info("teams", "Fetching url %s\n", real_url);
 	
 	request = purple_http_request_new(real_url);
@@ -91,8 +1012,15 @@ TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
 		purple_http_request_set_method(request, "DELETE");
 	}
 	if (keepalive) {
-		purple_http_request_set_keepalive_pool(request, sa->keepalive_pool);
+		purple_http_request_set_keepalive_pool(request, method & TEAMS_METHOD_LONGPOLL ? sa->longpoll_pool : sa->keepalive_pool);
+	}
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	if (method & TEAMS_METHOD_INTERACTIVE) {
+		purple_http_request_set_priority(request, PURPLE_HTTP_PRIORITY_HIGH);
+	} else if (method & TEAMS_METHOD_BACKGROUND) {
+		purple_http_request_set_priority(request, PURPLE_HTTP_PRIORITY_LOW);
 	}
+#endif
 	
 	purple_http_request_set_max_redirects(request, 0);
 	purple_http_request_set_timeout(request, 120);
@@ -113,92 +1041,63 @@ TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
 		}
 	}
 	
-	purple_http_request_header_set(request, "BehaviorOverride", "redirectAs404");
-#ifdef ENABLE_TEAMS_PERSONAL
-	purple_http_request_header_set(request, "X-MS-Client-Consumer-Type", "teams4life");
-#endif
+	teams_host_profile_apply(sa, request, host, url);
 	
-	if (g_str_equal(host, TEAMS_CONTACTS_HOST) || g_str_equal(host, TEAMS_VIDEOMAIL_HOST) || g_str_equal(host, TEAMS_NEW_CONTACTS_HOST)) {
-		purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-		purple_http_request_header_set(request, "X-Stratus-Caller", TEAMS_CLIENTINFO_NAME);
-		purple_http_request_header_set(request, "X-Stratus-Request", "abcd1234");
-		purple_http_request_header_set(request, "Origin", "https://" TEAMS_BASE_ORIGIN_HOST);
-		purple_http_request_header_set(request, "Referer", "https://" TEAMS_BASE_ORIGIN_HOST "/");
-		purple_http_request_header_set(request, "Accept", "application/json; ver=1.0;");
-		
-	} else if (g_str_equal(host, TEAMS_GRAPH_HOST)) {
-		purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-		purple_http_request_header_set(request, "Accept", "application/json");
-		
-	} else if (g_str_equal(host, sa->messages_host)) {
-		purple_http_request_header_set_printf(request, "Authentication", "skypetoken=%s", sa->skype_token);
-		purple_http_request_header_set(request, "Referer", "https://" TEAMS_BASE_ORIGIN_HOST "/");
-		purple_http_request_header_set(request, "Accept", "application/json; ver=1.0");
-		purple_http_request_header_set(request, "ClientInfo", "os=windows; osVer=10; proc=x86; lcid=en-us; deviceType=1; country=n/a; clientName=" TEAMS_CLIENTINFO_NAME "; clientVer=" TEAMS_CLIENTINFO_VERSION);
-		
-	} else if (g_str_equal(host, TEAMS_DEFAULT_CONTACT_SUGGESTIONS_HOST)) {
-		purple_http_request_header_set(request, "X-RecommenderServiceSettings", "{\"experiment\":\"default\",\"recommend\":\"true\"}");
-		purple_http_request_header_set(request, "X-ECS-ETag", TEAMS_CLIENTINFO_NAME);
-		purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-		purple_http_request_header_set(request, "Accept", "application/json");
-		purple_http_request_header_set(request, "X-Skype-Client", TEAMS_CLIENTINFO_VERSION);
-		
-	} else if (g_str_equal(host, TEAMS_PRESENCE_HOST)) {
-		if (sa->presence_access_token != NULL) {
-			purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->presence_access_token);
-		} else {
-			purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-		}
-		purple_http_request_header_set(request, "Accept", "application/json");
-		purple_http_request_header_set(request, "x-ms-client-user-agent", "Teams-Desktop");
-		purple_http_request_header_set(request, "x-ms-correlation-id", "1");
-		purple_http_request_header_set(request, "x-ms-client-version", "27/1.0.0.2023052414");
-		purple_http_request_header_set(request, "x-ms-endpoint-id", sa->endpoint);
-		
-	} else if (g_str_equal(host, "substrate.office.com")) {
-		purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->substrate_access_token);
-		purple_http_request_header_set(request, "Accept", "application/json");
-#ifdef ENABLE_TEAMS_PERSONAL
-		purple_http_request_header_set(request, "X-AnchorMailbox", sa->username);
-#endif
-		
-	} else if (g_str_equal(host, TEAMS_BASE_ORIGIN_HOST)) { // maybe chatsvcagg.teams.microsoft.com too?
-#ifdef ENABLE_TEAMS_PERSONAL
-		if (strstr(url, "/api/csa/") == url) {
-#else
-		if (strstr(url, "/api/csa/") == url && sa->csa_access_token != NULL) {
-			purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->csa_access_token);
-#endif
-		} else {
-			purple_http_request_header_set_printf(request, "Authorization", "Bearer %s", sa->id_token);
-		}
-		purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-		purple_http_request_header_set(request, "Accept", "application/json");
-		
-	} else {
-		purple_http_request_header_set(request, "Accept", "*/*");
-		purple_http_request_set_cookie_jar(request, sa->cookie_jar);
+	if (method & TEAMS_METHOD_CONDITIONAL) {
+		validator_key = teams_request_key(method, real_url, strcspn(real_url, "?"), postdata);
+		teams_validator_apply(sa, request, validator_key, real_url);
 	}
 	
-	/* Tell the server what language we accept, so that we get error messages in our language (rather than our IP's) */
-	languages = g_get_language_names();
-	language_names = g_strjoinv(", ", (gchar **)languages);
-	purple_util_chrreplace(language_names, '_', '-');
-	purple_http_request_header_set(request, "Accept-Language", language_names);
-	g_free(language_names);
-	
 	conn = g_new0(TeamsConnection, 1);
 	conn->sa = sa;
 	conn->user_data = user_data;
 	conn->url = real_url;
 	conn->callback = callback_func;
+	conn->validator_key = validator_key;
+	conn->request = request;
+	conn->host = g_strdup(host);
+	conn->path = real_url + strlen(real_url) - strlen(url);
+	conn->idempotent = (method & TEAMS_METHOD_COALESCE) || !(method & TEAMS_METHOD_POST);
+	conn->interactive = (method & TEAMS_METHOD_INTERACTIVE) != 0;
 	
-	conn->http_conn = purple_http_request(sa->pc, request, teams_post_or_get_cb, conn);
-	if (conn->http_conn != NULL) {
-		purple_http_connection_set_add(sa->conns, conn->http_conn);
+	if (array_member != NULL) {
+		conn->stream = teams_json_stream_new(array_member, element_func);
+		purple_http_request_set_response_writer(request, teams_json_stream_write, conn);
+		// Nothing is buffered besides the current element, so don't truncate
+		purple_http_request_set_max_len(request, -1);
 	}
 	
-	purple_http_request_unref(request);
+	if (teams_connection_send(conn)) {
+		if (inflight_key != NULL) {
+			if (sa->inflight_requests == NULL) {
+				sa->inflight_requests = g_hash_table_new(g_str_hash, g_str_equal);
+			}
+			conn->inflight_key = inflight_key;
+			g_hash_table_insert(sa->inflight_requests, inflight_key, conn);
+			inflight_key = NULL;
+		}
+	}
+	g_free(inflight_key);
 	
 	return conn;
 }
+
+TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
+		const gchar *host, const gchar *url, const gchar *postdata,
+		TeamsProxyCallbackFunc callback_func, gpointer user_data,
+		gboolean keepalive)
+{
+	return teams_post_or_get_full(sa, method, host, url, postdata, NULL, NULL, callback_func, user_data, keepalive);
+}
+
+TeamsConnection *teams_post_or_get_stream(TeamsAccount *sa, TeamsMethod method,
+		const gchar *host, const gchar *url, const gchar *postdata,
+		const gchar *array_member, TeamsProxyCallbackFunc element_func,
+		TeamsProxyCallbackFunc callback_func, gpointer user_data,
+		gboolean keepalive)
+{
+	g_return_val_if_fail(array_member != NULL, NULL);
+	g_return_val_if_fail(element_func != NULL, NULL);
+	
+	return teams_post_or_get_full(sa, method, host, url, postdata, array_member, element_func, callback_func, user_data, keepalive);
+}
@@ -33,9 +33,22 @@ typedef enum
 	TEAMS_METHOD_POST   = 0x0002,
 	TEAMS_METHOD_PUT    = 0x0004,
 	TEAMS_METHOD_DELETE = 0x0008,
+	TEAMS_METHOD_INTERACTIVE = 0x0100, // sends, typing, read markers: jump the queue
+	TEAMS_METHOD_BACKGROUND  = 0x0200, // profile/icon backfill: only when idle
+	TEAMS_METHOD_COALESCE    = 0x0400, // share replies like a GET, for read-only POSTs
+	TEAMS_METHOD_CONDITIONAL = 0x0800, // revalidate with ETag/Last-Modified, see TEAMS_NODE_NOT_MODIFIED
 	TEAMS_METHOD_SSL    = 0x1000,
+	TEAMS_METHOD_LONGPOLL    = 0x2000, // held open by the server: use sa->longpoll_pool
 } TeamsMethod;
 
+/*
+ * What the callback of a TEAMS_METHOD_CONDITIONAL request receives (a JSON null)
+ * when the server answered 304, i.e. nothing changed since the last response.
+ */
+#define TEAMS_NODE_NOT_MODIFIED(node) ((node) != NULL && JSON_NODE_HOLDS_NULL(node))
+
+typedef struct _TeamsJsonStream TeamsJsonStream;
+
 typedef struct _TeamsConnection TeamsConnection;
 struct _TeamsConnection {
 	TeamsAccount *sa;
@@ -44,6 +57,19 @@ struct _TeamsConnection {
 	gpointer user_data;
 	PurpleHttpConnection *http_conn;
 	TeamsProxyCallbackErrorFunc error_callback;
+	TeamsJsonStream *stream;
+	gchar *inflight_key;
+	GSList *followers; // identical requests waiting on this one's response
+	gchar *validator_key;
+	
+	PurpleHttpRequest *request;
+	gchar *host;
+	const gchar *path; // the tail of url
+	gboolean idempotent;
+	gboolean interactive;
+	guint attempts;
+	guint retry_delay;
+	guint retry_timeout;
 };
 
 TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
@@ -51,6 +77,31 @@ TeamsConnection *teams_post_or_get(TeamsAccount *sa, TeamsMethod method,
 		TeamsProxyCallbackFunc callback_func, gpointer user_data,
 		gboolean keepalive);
 
+/*
+ * Like teams_post_or_get(), but each element of the top-level array_member is
+ * parsed and passed to element_func as it arrives instead of being buffered.
+ * callback_func then receives the rest of the response, with that array empty.
+ */
+TeamsConnection *teams_post_or_get_stream(TeamsAccount *sa, TeamsMethod method,
+		const gchar *host, const gchar *url, const gchar *postdata,
+		const gchar *array_member, TeamsProxyCallbackFunc element_func,
+		TeamsProxyCallbackFunc callback_func, gpointer user_data,
+		gboolean keepalive);
+
+void teams_host_profiles_invalidate(TeamsAccount *sa);
+
+/*
+ * Completes every request still waiting on a retry or throttle timer, with no
+ * response, as if it had been cancelled.
+ */
+void teams_post_or_get_cancel_deferred(TeamsAccount *sa);
+
+/*
+ * Opens idle keep-alive connections to the hosts used right after login, so
+ * their DNS/TCP/TLS setup overlaps with authentication.
+ */
+void teams_prewarm_connections(TeamsAccount *sa);
+
 void teams_update_cookies(TeamsAccount *sa, const gchar *headers);		
 gchar *teams_cookies_to_string(TeamsAccount *sa);
 
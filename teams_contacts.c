@@ -69,18 +69,29 @@ typedef struct {
 	TeamsAccount *sa;
 } TeamsFileTransfer;
 
-static guint active_icon_downloads = 0;
+static void teams_icon_queue_process(TeamsAccount *sa);
 
 static void
 teams_get_icon_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
 	PurpleHttpRequest *request = purple_http_conn_get_request(http_conn);
-	PurpleBuddy *buddy = user_data;
+	PurpleConnection *pc = purple_http_conn_get_purple_connection(http_conn);
+	TeamsAccount *sa = purple_connection_get_protocol_data(pc);
+	gchar *buddy_name = user_data;
+	PurpleBuddy *buddy = NULL;
 	const gchar *url = purple_http_request_get_url(request);
 	const gchar *data;
 	gsize len;
 	
-	active_icon_downloads--;
+	if (sa != NULL) {
+		if (sa->icon_downloads_active > 0)
+			sa->icon_downloads_active--;
+		teams_icon_queue_process(sa);
+		
+		// The buddy could have been removed while we were downloading
+		buddy = purple_blist_find_buddy(sa->account, buddy_name);
+	}
+	g_free(buddy_name);
 	
 	if (!buddy || !purple_http_response_is_successful(response)) {
 		return;
@@ -103,6 +114,7 @@ teams_get_icon_now(PurpleBuddy *buddy)
 	TeamsAccount *sa;
 	gchar *url;
 	PurpleHttpRequest *request;
+	PurpleHttpConnection *http_conn;
 	
 	purple_debug_info("teams", "getting new buddy icon for %s\n", purple_buddy_get_name(buddy));
 	
@@ -129,6 +141,9 @@ teams_get_icon_now(PurpleBuddy *buddy)
 	
 	request = purple_http_request_new(url);
 	purple_http_request_set_keepalive_pool(request, sa->keepalive_pool);
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+	purple_http_request_set_priority(request, PURPLE_HTTP_PRIORITY_LOW);
+#endif
 	purple_http_request_set_max_redirects(request, 0);
 	purple_http_request_set_timeout(request, 120);
 	
@@ -138,33 +153,95 @@ teams_get_icon_now(PurpleBuddy *buddy)
 		purple_http_request_header_set_printf(request, "Cookie", "authtoken=Bearer%%3D%s%%26Origin%%3Dhttps%%3A%%2F%%2F" TEAMS_BASE_ORIGIN_HOST, purple_url_encode(sa->id_token));
 	}
 	
-	purple_http_request(sa->pc, request, teams_get_icon_cb, buddy);
+	sa->icon_downloads_active++;
+	http_conn = purple_http_request(sa->pc, request, teams_get_icon_cb, g_strdup(purple_buddy_get_name(buddy)));
+	if (http_conn != NULL) {
+		purple_http_connection_set_add(sa->conns, http_conn);
+	}
 	
 	purple_http_request_unref(request);
 	g_free(url);
+}
 
-	active_icon_downloads++;
+/* Start as many queued icon downloads as the concurrency cap allows */
+static void
+teams_icon_queue_process(TeamsAccount *sa)
+{
+	while (sa->icon_queue != NULL && !g_queue_is_empty(sa->icon_queue) &&
+			sa->icon_downloads_active < sa->icon_downloads_max) {
+		gchar *buddy_name = g_queue_pop_head(sa->icon_queue);
+		PurpleBuddy *buddy = purple_blist_find_buddy(sa->account, buddy_name);
+		
+		// Frees buddy_name
+		g_hash_table_remove(sa->icon_queued, buddy_name);
+		
+		if (buddy != NULL) {
+			teams_get_icon_now(buddy);
+		}
+	}
 }
 
-static gboolean
-teams_get_icon_queuepop(gpointer data)
+void
+teams_get_icon(PurpleBuddy *buddy)
 {
-	PurpleBuddy *buddy = data;
+	TeamsBuddy *sbuddy;
+	TeamsAccount *sa;
+	gchar *buddy_name;
 	
-	// Only allow 4 simultaneous downloads
-	if (active_icon_downloads > 4)
-		return TRUE;
+	if (!buddy) return;
 	
-	teams_get_icon_now(buddy);
-	return FALSE;
+	sbuddy = purple_buddy_get_protocol_data(buddy);
+	if (!sbuddy || !sbuddy->sa || !sbuddy->sa->icon_queue)
+		return;
+	sa = sbuddy->sa;
+	
+	// Already waiting for a download slot
+	if (g_hash_table_contains(sa->icon_queued, purple_buddy_get_name(buddy)))
+		return;
+	
+	buddy_name = g_strdup(purple_buddy_get_name(buddy));
+	g_queue_push_tail(sa->icon_queue, buddy_name);
+	g_hash_table_insert(sa->icon_queued, buddy_name, g_queue_peek_tail_link(sa->icon_queue));
+	
+	teams_icon_queue_process(sa);
 }
 
 void
-teams_get_icon(PurpleBuddy *buddy)
+teams_icon_queue_cancel(TeamsAccount *sa, const gchar *buddy_name)
 {
-	if (!buddy) return;
+	GList *link;
+	
+	if (sa == NULL || sa->icon_queue == NULL || buddy_name == NULL)
+		return;
+	
+	link = g_hash_table_lookup(sa->icon_queued, buddy_name);
+	if (link != NULL) {
+		g_queue_unlink(sa->icon_queue, link);
+		g_list_free_1(link);
+		g_hash_table_remove(sa->icon_queued, buddy_name);
+	}
+}
+
+void
+teams_icon_queue_init(TeamsAccount *sa)
+{
+	sa->icon_queue = g_queue_new();
+	sa->icon_queued = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	sa->icon_downloads_active = 0;
+	sa->icon_downloads_max = MAX(1, purple_account_get_int(sa->account, "icon_download_concurrency", TEAMS_DEFAULT_ICON_DOWNLOADS));
+}
+
+void
+teams_icon_queue_destroy(TeamsAccount *sa)
+{
+	if (sa->icon_queue == NULL)
+		return;
 	
-	g_timeout_add(100, teams_get_icon_queuepop, (gpointer)buddy);
+	// The names are owned by the icon_queued table
+	g_queue_free(sa->icon_queue);
+	sa->icon_queue = NULL;
+	g_hash_table_destroy(sa->icon_queued);
+	sa->icon_queued = NULL;
 }
 
 typedef struct SkypeImgMsgContext_ {
@@ -926,6 +1003,7 @@ teams_got_self_details(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 	
 	username = json_object_get_string_member(userobj, "skypeName");
 	g_free(sa->username); sa->username = g_strdup(username);
+	teams_host_profiles_invalidate(sa);
 	purple_connection_set_display_name(sa->pc, sa->username);
 	
 	old_alias = purple_account_get_private_alias(sa->account);
@@ -1246,8 +1324,8 @@ teams_get_friend_profiles(TeamsAccount *sa, GSList *contacts)
 	
 	g_string_append(postdata, "]");
 	
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, profiles_url, postdata->str, teams_got_friend_profiles, NULL, TRUE);
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, federated_profiles_url, postdata->str, teams_got_friend_profiles, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_BACKGROUND | TEAMS_METHOD_COALESCE, TEAMS_BASE_ORIGIN_HOST, profiles_url, postdata->str, teams_got_friend_profiles, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_BACKGROUND | TEAMS_METHOD_COALESCE, TEAMS_BASE_ORIGIN_HOST, federated_profiles_url, postdata->str, teams_got_friend_profiles, NULL, TRUE);
 	
 	g_string_free(postdata, TRUE);
 }
@@ -1443,86 +1521,148 @@ teams_find_chat_in_group(PurpleAccount *account, const char *id, PurpleGroup *gr
 	return teams_find_chat_from_node(account, id, PURPLE_BLIST_NODE(group));
 }
 
+/*
+ * The periodic friend list refresh is also what keeps contact statuses current, so
+ * when the directories come back unchanged (304), resubscribe everyone we already
+ * know of instead.  The directories are all fetched together; once per refresh is enough.
+ */
 static void
-teams_get_friend_list_teams_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+teams_friend_list_unchanged(TeamsAccount *sa)
 {
-	JsonObject *obj;
-	JsonArray *teams, *chats, *users;
-	guint index, length;
+	GSList *buddies, *names = NULL;
+	
+	if (time(NULL) - sa->friend_list_unchanged_at < 60) {
+		return;
+	}
+	sa->friend_list_unchanged_at = time(NULL);
+	
+	buddies = purple_blist_find_buddies(sa->account, NULL);
+	while (buddies != NULL) {
+		names = g_slist_prepend(names, (gchar *) purple_buddy_get_name(buddies->data));
+		buddies = g_slist_delete_link(buddies, buddies);
+	}
+	teams_subscribe_to_contact_status(sa, names);
+	g_slist_free(names);
+}
+
+/*
+ * The friend list responses can run to several megabytes on large tenants, so
+ * they're streamed one contact/chat at a time.  The users seen along the way are
+ * collected into a GSList ** and fetched in one go once the response is complete.
+ */
+static void
+teams_streamed_users_free(GSList **users_to_fetch)
+{
+	g_slist_free_full(*users_to_fetch, g_free);
+	g_free(users_to_fetch);
+}
+
+static void
+teams_streamed_users_fetch(TeamsAccount *sa, GSList **users_to_fetch)
+{
+	if (*users_to_fetch)
+	{
+		teams_get_friend_profiles(sa, *users_to_fetch);
+		teams_subscribe_to_contact_status(sa, *users_to_fetch);
+	}
+	teams_streamed_users_free(users_to_fetch);
+}
+
+static void
+teams_streamed_users_error(TeamsAccount *sa, const gchar *data, gssize data_len, gpointer user_data)
+{
+	purple_debug_error("teams", "Error parsing friend list response: %s\n", data);
+	teams_streamed_users_free(user_data);
+}
+
+static void
+teams_got_friend_list_chat(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+{
+	GSList **users_to_fetch = user_data;
 	PurpleGroup *group = teams_get_blist_group(sa);
-	GSList *users_to_fetch = NULL;
 	PurpleBuddy *buddy;
 	
-	obj = json_node_get_object(node);
+	if (json_node_get_node_type(node) != JSON_NODE_OBJECT)
+		return;
 	
-	// Group chats
-	chats = json_object_get_array_member(obj, "chats");
-	length = json_array_get_length(chats);
-	for(index = 0; index < length; index++)
-	{
-		JsonObject *chat = json_array_get_object_element(chats, index);
-		const gchar *id = json_object_get_string_member(chat, "id");
-		gboolean is_one_on_one = json_object_get_boolean_member(chat, "isOneOnOne");
+	JsonObject *chat = json_node_get_object(node);
+	const gchar *id = json_object_get_string_member(chat, "id");
+	gboolean is_one_on_one = json_object_get_boolean_member(chat, "isOneOnOne");
+	
+	if (is_one_on_one) {
+		JsonArray *members = json_object_get_array_member(chat, "members");
+		JsonObject *member = json_array_get_object_element(members, 0);
+		const gchar *mri = json_object_get_string_member(member, "mri");
+		const gchar *buddyid = teams_strip_user_prefix(mri);
 		
-		if (is_one_on_one) {
-			JsonArray *members = json_object_get_array_member(chat, "members");
-			JsonObject *member = json_array_get_object_element(members, 0);
-			const gchar *mri = json_object_get_string_member(member, "mri");
-			const gchar *buddyid = teams_strip_user_prefix(mri);
-			
-			if (teams_is_user_self(sa, buddyid)) {
-				// There were two in the bed and the little one said....
-				member = json_array_get_object_element(members, 1);
-				if (member == NULL) {
-					// ... goodnight!
-					continue;
-				}
-				mri = json_object_get_string_member(member, "mri");
-				buddyid = teams_strip_user_prefix(mri);
+		if (teams_is_user_self(sa, buddyid)) {
+			// There were two in the bed and the little one said....
+			member = json_array_get_object_element(members, 1);
+			if (member == NULL) {
+				// ... goodnight!
+				return;
 			}
+			mri = json_object_get_string_member(member, "mri");
+			buddyid = teams_strip_user_prefix(mri);
+		}
+		
+		*users_to_fetch = g_slist_prepend(*users_to_fetch, g_strdup(buddyid));
+		
+		//Create an array of one to one mappings for IMs
+		g_hash_table_insert(sa->buddy_to_chat_lookup, g_strdup(buddyid), g_strdup(id));
+		g_hash_table_insert(sa->chat_to_buddy_lookup, g_strdup(id), g_strdup(buddyid));
+		
+		buddy = purple_blist_find_buddy(sa->account, buddyid);
+		if (!buddy)
+		{
+			buddy = purple_buddy_new(sa->account, buddyid, NULL);
+			purple_blist_add_buddy(buddy, NULL, group, NULL);
+		}
+		
+	} else {
+		const gchar *title = json_object_get_string_member(chat, "title");
+		PurpleChat *purple_chat = teams_find_chat(sa->account, id);
+		
+		if (purple_chat == NULL) {
+			GHashTable *components = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+			g_hash_table_replace(components, g_strdup("chatname"), g_strdup(id));
 			
-			users_to_fetch = g_slist_prepend(users_to_fetch, g_strdup(buddyid));
-			
-			//Create an array of one to one mappings for IMs
-			g_hash_table_insert(sa->buddy_to_chat_lookup, g_strdup(buddyid), g_strdup(id));
-			g_hash_table_insert(sa->chat_to_buddy_lookup, g_strdup(id), g_strdup(buddyid));
-			
-			buddy = purple_blist_find_buddy(sa->account, buddyid);
-			if (!buddy)
-			{
-				buddy = purple_buddy_new(sa->account, buddyid, NULL);
-				purple_blist_add_buddy(buddy, NULL, group, NULL);
-			}
+			purple_chat = purple_chat_new(sa->account, title, components);
+			purple_blist_add_chat(purple_chat, group, NULL);
 			
 		} else {
-			const gchar *title = json_object_get_string_member(chat, "title");
-			PurpleChat *purple_chat = teams_find_chat(sa->account, id);
+			purple_chat_set_alias(purple_chat, title);
 			
-			if (purple_chat == NULL) {
-				GHashTable *components = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-				g_hash_table_replace(components, g_strdup("chatname"), g_strdup(id));
-				
-				purple_chat = purple_chat_new(sa->account, title, components);
-				purple_blist_add_chat(purple_chat, group, NULL);
-				
-			} else {
-				purple_chat_set_alias(purple_chat, title);
-				
-			}
-			
-			JsonArray *members = json_object_get_array_member(chat, "members");
-			guint members_index, members_length = json_array_get_length(members);
+		}
+		
+		JsonArray *members = json_object_get_array_member(chat, "members");
+		guint members_index, members_length = json_array_get_length(members);
+		
+		for(members_index = 0; members_index < members_length; members_index++)
+		{
+			JsonObject *member = json_array_get_object_element(members, members_index);
+			const gchar *mri = json_object_get_string_member(member, "mri");
+			const gchar *buddyid = teams_strip_user_prefix(mri);
 			
-			for(members_index = 0; members_index < members_length; members_index++)
-			{
-				JsonObject *member = json_array_get_object_element(members, members_index);
-				const gchar *mri = json_object_get_string_member(member, "mri");
-				const gchar *buddyid = teams_strip_user_prefix(mri);
-				
-				users_to_fetch = g_slist_prepend(users_to_fetch, g_strdup(buddyid));
-			}
+			*users_to_fetch = g_slist_prepend(*users_to_fetch, g_strdup(buddyid));
 		}
 	}
+}
+
+static void
+teams_get_friend_list_teams_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+{
+	JsonObject *obj;
+	JsonArray *teams, *users;
+	
+	if (TEAMS_NODE_NOT_MODIFIED(node)) {
+		teams_friend_list_unchanged(sa);
+	}
+	if (node == NULL || json_node_get_node_type(node) != JSON_NODE_OBJECT) {
+		teams_streamed_users_free(user_data);
+		return;
+	}
+	obj = json_node_get_object(node);
 	
 	// Teams
 	teams = json_object_get_array_member(obj, "teams");
@@ -1533,12 +1673,7 @@ teams_get_friend_list_teams_cb(TeamsAccount *sa, JsonNode *node, gpointer user_d
 	users = json_object_get_array_member(obj, "users");
 	(void) users;
 	
-	if (users_to_fetch)
-	{
-		teams_get_friend_profiles(sa, users_to_fetch);
-		teams_subscribe_to_contact_status(sa, users_to_fetch);
-		g_slist_free_full(users_to_fetch, g_free);
-	}
+	teams_streamed_users_fetch(sa, user_data);
 }
 
 static void
@@ -1550,6 +1685,11 @@ teams_get_friend_suggestions_cb(TeamsAccount *sa, JsonNode *node, gpointer user_
 	GSList *users_to_fetch = NULL;
 	guint index, length;
 	
+	if (TEAMS_NODE_NOT_MODIFIED(node)) {
+		teams_friend_list_unchanged(sa);
+		return;
+	}
+	
 	obj = json_node_get_object(node);
 	groups = json_object_get_array_member(obj, "Groups");
 	firstgroup = json_array_get_object_element(groups, 0);
@@ -1624,6 +1764,11 @@ teams_get_workingwith_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 	GSList *users_to_fetch = NULL;
 	guint index, length;
 	
+	if (TEAMS_NODE_NOT_MODIFIED(node)) {
+		teams_friend_list_unchanged(sa);
+		return;
+	}
+	
 	obj = json_node_get_object(node);
 	contacts = json_object_get_array_member(obj, "value");
 	length = json_array_get_length(contacts);
@@ -1679,100 +1824,100 @@ teams_get_workingwith_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 }
 
 static void
-teams_get_friend_list_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+teams_got_friend_list_contact(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 {
-	JsonObject *obj;
-	JsonArray *contacts;
+	GSList **users_to_fetch = user_data;
 	PurpleGroup *group = teams_get_blist_group(sa);
-	GSList *users_to_fetch = NULL;
-	guint index, length;
 	
-	obj = json_node_get_object(node);
-	contacts = json_object_get_array_member(obj, "value");
-	length = json_array_get_length(contacts);
+	if (json_node_get_node_type(node) != JSON_NODE_OBJECT)
+		return;
 	
-	for(index = 0; index < length; index++)
+	JsonObject *contact = json_node_get_object(node);
+	const gchar *type = json_object_get_string_member(contact, "type");
+	
+	if (purple_strequal(type, "Group")) {
+		return;
+	}
+	
+	const gchar *mri = json_object_get_string_member(contact, "mri");
+	const gchar *display_name = json_object_get_string_member(contact, "displayName");
+	// const gchar *avatar_url = NULL;
+	// gboolean authorized = json_object_get_boolean_member(contact, "authorized");
+	// gboolean blocked = json_object_get_boolean_member(contact, "blocked");
+	
+	// const gchar *mood = json_object_get_string_member(profile, "mood");
+	// JsonObject *name = json_object_get_object_member(profile, "name");
+	const gchar *firstname = json_object_get_string_member(contact, "givenName");
+	const gchar *surname = json_object_get_string_member(contact, "surname");
+	
+	PurpleBuddy *buddy;
+	const gchar *id;
+	
+	id = teams_strip_user_prefix(mri);
+	
+	buddy = purple_blist_find_buddy(sa->account, id);
+	if (!buddy)
 	{
-		JsonObject *contact = json_array_get_object_element(contacts, index);
-		const gchar *type = json_object_get_string_member(contact, "type");
-		
-		if (purple_strequal(type, "Group")) {
-			continue;
-		}
-		
-		const gchar *mri = json_object_get_string_member(contact, "mri");
-		const gchar *display_name = json_object_get_string_member(contact, "displayName");
-		// const gchar *avatar_url = NULL;
-		// gboolean authorized = json_object_get_boolean_member(contact, "authorized");
-		// gboolean blocked = json_object_get_boolean_member(contact, "blocked");
-		
-		// const gchar *mood = json_object_get_string_member(profile, "mood");
-		// JsonObject *name = json_object_get_object_member(profile, "name");
-		const gchar *firstname = json_object_get_string_member(contact, "givenName");
-		const gchar *surname = json_object_get_string_member(contact, "surname");
-		
-		PurpleBuddy *buddy;
-		const gchar *id;
-		
-		id = teams_strip_user_prefix(mri);
-		
-		buddy = purple_blist_find_buddy(sa->account, id);
-		if (!buddy)
-		{
-			buddy = purple_buddy_new(sa->account, id, display_name);
-			purple_blist_add_buddy(buddy, NULL, group, NULL);
-		}
+		buddy = purple_buddy_new(sa->account, id, display_name);
+		purple_blist_add_buddy(buddy, NULL, group, NULL);
+	}
 
-		TeamsBuddy *sbuddy = purple_buddy_get_protocol_data(buddy);
-		if (sbuddy == NULL) {
-			sbuddy = g_new0(TeamsBuddy, 1);
-			sbuddy->skypename = g_strdup(id);
-			sbuddy->sa = sa;
-			
-			sbuddy->buddy = buddy;
-			purple_buddy_set_protocol_data(buddy, sbuddy);
-		}
-		
-		g_free(sbuddy->fullname);
-		sbuddy->fullname = g_strconcat(firstname, (surname ? " " : NULL), surname, NULL);
-		g_free(sbuddy->display_name);
-		sbuddy->display_name = g_strdup(display_name);
+	TeamsBuddy *sbuddy = purple_buddy_get_protocol_data(buddy);
+	if (sbuddy == NULL) {
+		sbuddy = g_new0(TeamsBuddy, 1);
+		sbuddy->skypename = g_strdup(id);
+		sbuddy->sa = sa;
 		
-		if (sbuddy->display_name && *sbuddy->display_name && !purple_strequal(purple_buddy_get_local_alias(buddy), sbuddy->display_name)) {
-			purple_serv_got_alias(sa->pc, id, sbuddy->display_name);
-		}
-		if (sbuddy->fullname && *sbuddy->fullname && !purple_strequal(purple_buddy_get_server_alias(buddy), sbuddy->fullname)) {
-			purple_buddy_set_server_alias(buddy, sbuddy->fullname);
-		}
-		
-		// if (json_object_has_member(profile, "avatar_url")) {
-			// avatar_url = json_object_get_string_member(profile, "avatar_url");
-			// if (avatar_url && *avatar_url && (!sbuddy->avatar_url || !g_str_equal(sbuddy->avatar_url, avatar_url))) {
-				// g_free(sbuddy->avatar_url);
-				// sbuddy->avatar_url = g_strdup(avatar_url);			
-				// teams_get_icon(buddy);
-			// }
-		// }
-		teams_get_icon(buddy);
-		
-		// if (blocked == TRUE) {
-			// purple_account_privacy_deny_add(sa->account, id, TRUE);
-		// } else {
-			users_to_fetch = g_slist_prepend(users_to_fetch, sbuddy->skypename);
-		// }
-		
-		if (purple_strequal(id, sa->primary_member_name)) {
-			g_free(sa->self_display_name);
-			sa->self_display_name = g_strdup(display_name);
-		}
+		sbuddy->buddy = buddy;
+		purple_buddy_set_protocol_data(buddy, sbuddy);
 	}
 	
-	if (users_to_fetch)
-	{
-		teams_get_friend_profiles(sa, users_to_fetch);
-		teams_subscribe_to_contact_status(sa, users_to_fetch);
-		g_slist_free(users_to_fetch);
+	g_free(sbuddy->fullname);
+	sbuddy->fullname = g_strconcat(firstname, (surname ? " " : NULL), surname, NULL);
+	g_free(sbuddy->display_name);
+	sbuddy->display_name = g_strdup(display_name);
+	
+	if (sbuddy->display_name && *sbuddy->display_name && !purple_strequal(purple_buddy_get_local_alias(buddy), sbuddy->display_name)) {
+		purple_serv_got_alias(sa->pc, id, sbuddy->display_name);
 	}
+	if (sbuddy->fullname && *sbuddy->fullname && !purple_strequal(purple_buddy_get_server_alias(buddy), sbuddy->fullname)) {
+		purple_buddy_set_server_alias(buddy, sbuddy->fullname);
+	}
+	
+	// if (json_object_has_member(profile, "avatar_url")) {
+		// avatar_url = json_object_get_string_member(profile, "avatar_url");
+		// if (avatar_url && *avatar_url && (!sbuddy->avatar_url || !g_str_equal(sbuddy->avatar_url, avatar_url))) {
+			// g_free(sbuddy->avatar_url);
+			// sbuddy->avatar_url = g_strdup(avatar_url);			
+			// teams_get_icon(buddy);
+		// }
+	// }
+	teams_get_icon(buddy);
+	
+	// if (blocked == TRUE) {
+		// purple_account_privacy_deny_add(sa->account, id, TRUE);
+	// } else {
+		*users_to_fetch = g_slist_prepend(*users_to_fetch, g_strdup(sbuddy->skypename));
+	// }
+	
+	if (purple_strequal(id, sa->primary_member_name)) {
+		g_free(sa->self_display_name);
+		sa->self_display_name = g_strdup(display_name);
+	}
+}
+
+static void
+teams_get_friend_list_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+{
+	if (TEAMS_NODE_NOT_MODIFIED(node)) {
+		teams_friend_list_unchanged(sa);
+	}
+	if (node == NULL || json_node_get_node_type(node) != JSON_NODE_OBJECT) {
+		teams_streamed_users_free(user_data);
+		return;
+	}
+	
+	teams_streamed_users_fetch(sa, user_data);
 }
 
 static void
@@ -1784,6 +1929,11 @@ teams_get_buddylist_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 	GSList *users_to_fetch = NULL;
 	guint index, length;
 	
+	if (TEAMS_NODE_NOT_MODIFIED(node)) {
+		teams_friend_list_unchanged(sa);
+		return;
+	}
+	
 	obj = json_node_get_object(node);
 	values = json_object_get_array_member(obj, "value");
 	length = json_array_get_length(values);
@@ -1866,31 +2016,36 @@ teams_get_friend_list(TeamsAccount *sa)
 	}
 
 	const gchar *url = TEAMS_PROFILES_PREFIX "users/searchV2?includeDLs=true&includeBots=true&enableGuest=true&source=newChat&skypeTeamsInfo=true";
+	TeamsConnection *conn;
 	
 	//TODO
 	// get tenants: https://teams.microsoft.com/api/mt/apac/beta/users/tenants
 	
 	// Do a search for all users with . in their email addresses - doesn't work for Guests
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, url, ".", teams_get_friend_list_cb, NULL, TRUE);
+	conn = teams_post_or_get_stream(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, TEAMS_BASE_ORIGIN_HOST, url, ".", "value", teams_got_friend_list_contact, teams_get_friend_list_cb, g_new0(GSList *, 1), TRUE);
+	if (conn != NULL)
+		conn->error_callback = teams_streamed_users_error;
 	
 	// Fetch a list of teams and chats we're part of - doesn't include users for Guests
 	url = "/api/csa/api/v1/teams/users/me?isPrefetch=false&enableMembershipSummary=true";
-	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, url, NULL, teams_get_friend_list_teams_cb, NULL, TRUE);
+	conn = teams_post_or_get_stream(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, TEAMS_BASE_ORIGIN_HOST, url, NULL, "chats", teams_got_friend_list_chat, teams_get_friend_list_teams_cb, g_new0(GSList *, 1), TRUE);
+	if (conn != NULL)
+		conn->error_callback = teams_streamed_users_error;
 	
 	// Search all of office for suggestions
 	// needs auth with scope of https://substrate.office.com
 	url = "/search/api/v1/suggestions?scenario=";
 	const gchar *postdata = "{\"EntityRequests\":[{\"EntityType\":\"People\",\"Fields\":[\"DisplayName\",\"MRI\",\"GivenName\",\"Surname\"],\"Query\":{\"QueryString\":\"\",\"DisplayQueryString\":\"\"},\"Provenances\":[\"Mailbox\",\"Directory\"],\"Filter\":{\"And\":[{\"Or\":[{\"Term\":{\"PeopleType\":\"Person\"}},{\"Term\":{\"PeopleType\":\"Other\"}}]},{\"Or\":[{\"Term\":{\"PeopleSubtype\":\"OrganizationUser\"}},{\"Term\":{\"PeopleSubtype\":\"Guest\"}}]}]},\"Size\":500,\"From\":0}],\"Cvid\":\"12345678-1234-4321-1234-123412341234\",\"AppName\":\"Microsoft Teams\",\"Scenario\":{\"Name\":\"peoplecache\"}}";
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, "substrate.office.com", url, postdata, teams_get_friend_suggestions_cb, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, "substrate.office.com", url, postdata, teams_get_friend_suggestions_cb, NULL, TRUE);
 
 	// Search org chart for people you work with
 	gchar *search_url = g_strconcat("/api/v1/workingwith?teamsMri=", purple_url_encode(sa->primary_member_name), "&personaType=User&limit=50", NULL);
-	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, "aus.loki.delve.office.com", search_url, NULL, teams_get_workingwith_cb, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, "aus.loki.delve.office.com", search_url, NULL, teams_get_workingwith_cb, NULL, TRUE);
 	g_free(search_url);
 
 	// Teams personal has a buddy list?!@
 	url = "/api/mt/beta/contacts/buddylist?migrationRequested=true&federatedContactsSupported=true";
-	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, url, NULL, teams_get_buddylist_cb, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, TEAMS_BASE_ORIGIN_HOST, url, NULL, teams_get_buddylist_cb, NULL, TRUE);
 
 	return TRUE;
 }
@@ -1943,7 +2098,8 @@ teams_got_calendar(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 	JsonArray *events;
 	guint index, length;
 	
-	if (node == NULL)
+	// Unchanged calendars have their reminders set already
+	if (node == NULL || TEAMS_NODE_NOT_MODIFIED(node))
 		return;
 	obj = json_node_get_object(node);
 	events = json_object_get_array_member(obj, "value");
@@ -2014,7 +2170,7 @@ teams_check_calendar(TeamsAccount *sa)
 		
 		gchar *url = g_strconcat("/api/mt/part/au-01/v2.0/me/calendars/default/calendarView?StartDate=", start_date, "&EndDate=", end_date, "&shouldDecryptData=true", NULL);
 
-		teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, TEAMS_BASE_ORIGIN_HOST, url, NULL, teams_got_calendar, NULL, TRUE);
+		teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL | TEAMS_METHOD_CONDITIONAL, TEAMS_BASE_ORIGIN_HOST, url, NULL, teams_got_calendar, NULL, TRUE);
 
 		g_free(start_date);
 		g_free(end_date);
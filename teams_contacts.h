@@ -22,6 +22,9 @@
 #include "libteams.h"
 
 void teams_get_icon(PurpleBuddy *buddy);
+void teams_icon_queue_init(TeamsAccount *sa);
+void teams_icon_queue_destroy(TeamsAccount *sa);
+void teams_icon_queue_cancel(TeamsAccount *sa, const gchar *buddy_name);
 void teams_download_uri_to_conv(TeamsAccount *sa, const gchar *uri, PurpleConversation *conv, time_t ts, const gchar* from);
 void teams_download_video_message(TeamsAccount *sa, const gchar *sid, PurpleConversation *conv);
 void teams_download_moji_to_conv(TeamsAccount *sa, const gchar *text, const gchar *url_thumbnail, PurpleConversation *conv, time_t ts, const gchar* from);
@@ -180,6 +180,7 @@ teams_login_did_got_api_skypetoken(PurpleHttpConnection *http_conn, PurpleHttpRe
 
 	if (sa->skype_token) g_free(sa->skype_token);
 	sa->skype_token = g_strdup(skypeToken);
+	teams_host_profiles_invalidate(sa);
 	
 	gint64 expiresIn = json_object_get_int_member(tokens, "expiresIn");
 	if (sa->refresh_token_timeout) 
@@ -363,6 +364,7 @@ teams_presence_oauth_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *res
 			g_free(sa->presence_access_token);
 		}
 		sa->presence_access_token = presence_access_token;
+		teams_host_profiles_invalidate(sa);
 	}
 
 	json_object_unref(obj);
@@ -409,6 +411,7 @@ teams_substrate_oauth_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *re
 			g_free(sa->substrate_access_token);
 		}
 		sa->substrate_access_token = substrate_access_token;
+		teams_host_profiles_invalidate(sa);
 	}
 
 	json_object_unref(obj);
@@ -680,7 +683,7 @@ teams_devicecode_login_poll(gpointer user_data)
 	g_string_append_printf(postdata, "code=%s", purple_url_encode(sa->login_device_code));
 	
 	request = purple_http_request_new(auth_url);
-	purple_http_request_set_keepalive_pool(request, sa->keepalive_pool);
+	purple_http_request_set_keepalive_pool(request, sa->longpoll_pool);
 	purple_http_request_set_cookie_jar(request, sa->cookie_jar);
 	purple_http_request_set_method(request, "POST");
 	purple_http_request_header_set(request, "Content-Type", "application/x-www-form-urlencoded");
@@ -1030,7 +1030,7 @@ process_message_resource(TeamsAccount *sa, JsonObject *resource)
 			// Should be [messageId];[timestampInMillis];[clientMessageId]
 			post = g_strdup_printf("{\"consumptionhorizon\":\"%s;%" G_GINT64_FORMAT ";%s\"}", id ? id : "", teams_get_js_time(), id ? id : "");
 			
-			teams_post_or_get(sa, TEAMS_METHOD_PUT | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
+			teams_post_or_get(sa, TEAMS_METHOD_PUT | TEAMS_METHOD_SSL | TEAMS_METHOD_INTERACTIVE, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
 			
 			g_free(post);
 			g_free(url);
@@ -1176,15 +1176,172 @@ process_endpointpresence_resource(TeamsAccount *sa, JsonObject *resource)
 	}
 }
 
-gboolean
+static gboolean
 teams_timeout(gpointer userdata)
 {
 	TeamsAccount *sa = userdata;
+	
+	sa->poll_timeout = 0;
 	teams_poll(sa);
 	
+	return FALSE;
+}
+
+static gboolean
+teams_poll_watchdog(gpointer userdata)
+{
+	TeamsAccount *sa = userdata;
+	
 	// If no response within 1 minute, assume connection lost and try again
-	g_source_remove(sa->watchdog_timeout);
-	sa->watchdog_timeout = g_timeout_add_seconds(60, teams_timeout, sa);
+	if (sa->poll_conn != NULL && time(NULL) - sa->poll_started >= TEAMS_POLL_WATCHDOG_SECONDS) {
+		teams_poll(sa);
+	}
+	
+	return TRUE;
+}
+
+static void
+teams_poll_schedule(TeamsAccount *sa)
+{
+	guint delay;
+	
+	if (teams_trouter_is_healthy(sa)) {
+		// Trouter is pushing events, the poll is just a safety net,
+		// even when it returns the events trouter already delivered
+		sa->poll_backoff = 0;
+		delay = TEAMS_POLL_TROUTER_INTERVAL_SECONDS;
+	} else if (sa->poll_events > 0) {
+		// Something is happening, go straight back for more
+		sa->poll_backoff = 0;
+		delay = 0;
+	} else {
+		delay = MAX(sa->poll_backoff, 1);
+		sa->poll_backoff = MIN(delay * 2, TEAMS_POLL_MAX_BACKOFF_SECONDS);
+	}
+	
+	if (sa->poll_timeout) {
+		g_source_remove(sa->poll_timeout);
+	}
+	sa->poll_timeout = g_timeout_add_seconds(delay, teams_timeout, sa);
+}
+
+void
+teams_poll_wake(TeamsAccount *sa)
+{
+	// Trouter went away, don't wait out the slow safety-net interval
+	if (sa->poll_conn == NULL && sa->poll_timeout && !purple_connection_is_disconnecting(sa->pc)) {
+		sa->poll_backoff = 0;
+		g_source_remove(sa->poll_timeout);
+		sa->poll_timeout = g_timeout_add_seconds(1, teams_timeout, sa);
+	}
+}
+
+typedef struct {
+	gchar *key;
+	gint64 seen;
+} TeamsEventIndexEntry;
+
+typedef struct _TeamsEventIndex {
+	TeamsEventIndexEntry ring[TEAMS_EVENT_INDEX_SIZE];
+	guint next;
+	GHashTable *lookup; // key -> slot + 1, keys owned by the ring
+	guint hits;
+	guint misses;
+} TeamsEventIndex;
+
+void
+teams_event_index_init(TeamsAccount *sa)
+{
+	sa->event_index = g_new0(TeamsEventIndex, 1);
+	sa->event_index->lookup = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+void
+teams_event_index_destroy(TeamsAccount *sa)
+{
+	TeamsEventIndex *index = sa->event_index;
+	guint i;
+	
+	if (index == NULL) {
+		return;
+	}
+	
+	purple_debug_info("teams", "Event index: %u duplicates dropped, %u events processed\n", index->hits, index->misses);
+	
+	g_hash_table_destroy(index->lookup);
+	for (i = 0; i < TEAMS_EVENT_INDEX_SIZE; i++) {
+		g_free(index->ring[i].key);
+	}
+	g_free(index);
+	sa->event_index = NULL;
+}
+
+static gchar *
+teams_event_index_key(JsonObject *message)
+{
+	const gchar *resourceType = json_object_get_string_member(message, "resourceType");
+	const gchar *resourceLink = json_object_get_string_member(message, "resourceLink");
+	const gchar *event_time = json_object_get_string_member(message, "time");
+	JsonObject *resource = json_object_get_object_member(message, "resource");
+	
+	if (purple_strequal(resourceType, "NewMessage") || purple_strequal(resourceType, "MessageUpdate")) {
+		// Edits keep the message id but bump the version
+		const gchar *id = json_object_get_string_member(resource, "id");
+		const gchar *version = json_object_get_string_member(resource, "version");
+		
+		if (id != NULL) {
+			return g_strconcat("m/", id, "/", version ? version : "", NULL);
+		}
+	}
+	
+	// Same event replayed on the other channel has the same link and server timestamp
+	if (resourceLink != NULL && event_time != NULL) {
+		return g_strconcat("e/", resourceLink, "/", event_time, NULL);
+	}
+	
+	return NULL;
+}
+
+gboolean
+teams_event_index_seen(TeamsAccount *sa, JsonObject *message)
+{
+	TeamsEventIndex *index = sa->event_index;
+	TeamsEventIndexEntry *entry;
+	gchar *key;
+	guint slot;
+	gint64 now;
+	
+	if (index == NULL || message == NULL) {
+		return FALSE;
+	}
+	
+	key = teams_event_index_key(message);
+	if (key == NULL) {
+		return FALSE;
+	}
+	
+	now = (gint64) time(NULL);
+	slot = GPOINTER_TO_UINT(g_hash_table_lookup(index->lookup, key));
+	if (slot && now - index->ring[slot - 1].seen <= TEAMS_EVENT_INDEX_WINDOW_SECONDS) {
+		index->hits++;
+		g_free(key);
+		return TRUE;
+	}
+	index->misses++;
+	
+	// Evict the oldest slot, unless its key has since been re-recorded elsewhere
+	entry = &index->ring[index->next];
+	if (entry->key != NULL) {
+		if (GPOINTER_TO_UINT(g_hash_table_lookup(index->lookup, entry->key)) == index->next + 1) {
+			g_hash_table_remove(index->lookup, entry->key);
+		}
+		g_free(entry->key);
+	}
+	
+	entry->key = key;
+	entry->seen = now;
+	g_hash_table_replace(index->lookup, key, GUINT_TO_POINTER(index->next + 1));
+	index->next = (index->next + 1) % TEAMS_EVENT_INDEX_SIZE;
 	
 	return FALSE;
 }
@@ -1219,6 +1376,20 @@ teams_process_event_message(TeamsAccount *sa, JsonObject *message)
 	}
 }
 
+static void
+teams_poll_event_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+{
+	// Called once per eventMessages entry while the poll response is still arriving
+	if (node != NULL && json_node_get_node_type(node) == JSON_NODE_OBJECT) {
+		JsonObject *message = json_node_get_object(node);
+		
+		sa->poll_events++;
+		if (!teams_event_index_seen(sa, message)) {
+			teams_process_event_message(sa, message);
+		}
+	}
+}
+
 static void
 teams_poll_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 {
@@ -1245,6 +1416,9 @@ teams_poll_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 			gchar *next_server = teams_string_get_chunk(next, -1, "https://", "/users");
 			
 			if (next_server != NULL) {
+				if (!purple_strequal(sa->messages_host, next_server)) {
+					teams_host_profiles_invalidate(sa);
+				}
 				g_free(sa->messages_host);
 				sa->messages_host = next_server;
 			}
@@ -1264,7 +1438,10 @@ teams_poll_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 			for(index = 0; index < length; index++)
 			{
 				JsonObject *message = json_array_get_object_element(messages, index);
-				teams_process_event_message(sa, message);
+				sa->poll_events++;
+				if (!teams_event_index_seen(sa, message)) {
+					teams_process_event_message(sa, message);
+				}
 			}
 		} else if (json_object_has_member(obj, "errorCode")) {
 			gint64 errorCode = json_object_get_int_member(obj, "errorCode");
@@ -1282,14 +1459,12 @@ teams_poll_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 			teams_subscribe(sa);
 		}
 		
-		//TODO record id of highest recieved id to make sure we dont process the same id twice
-		
 	} else {
 		// No data received, or timeout
 	}
 	
 	if (!purple_connection_is_disconnecting(sa->pc)) {
-		sa->poll_timeout = g_timeout_add_seconds(1, teams_timeout, sa);
+		teams_poll_schedule(sa);
 	}
 
 	// poll_conn is free'd by parent function
@@ -1330,7 +1505,17 @@ teams_poll(TeamsAccount *sa)
 		g_string_append_printf(url, "?cursor=%s", sa->messages_cursor);
 	}
 	
-	sa->poll_conn = teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, sa->messages_host, url->str, NULL, teams_poll_cb, NULL, TRUE);
+	if (sa->poll_timeout) {
+		g_source_remove(sa->poll_timeout);
+		sa->poll_timeout = 0;
+	}
+	if (!sa->watchdog_timeout) {
+		sa->watchdog_timeout = g_timeout_add_seconds(TEAMS_POLL_WATCHDOG_SECONDS / 2, teams_poll_watchdog, sa);
+	}
+	sa->poll_started = time(NULL);
+	sa->poll_events = 0;
+	
+	sa->poll_conn = teams_post_or_get_stream(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL | TEAMS_METHOD_LONGPOLL, sa->messages_host, url->str, NULL, "eventMessages", teams_poll_event_cb, teams_poll_cb, NULL, TRUE);
 	
 	g_string_free(url, TRUE);
 }
@@ -1364,7 +1549,7 @@ teams_mark_conv_seen(PurpleConversation *conv, PurpleConversationUpdateType type
 				// Should be [messageId];[timestampInMillis];[clientMessageId]
 				post = g_strdup_printf("{\"consumptionhorizon\":\"%s;%" G_GINT64_FORMAT ";%s\"}", last_teams_id, teams_get_js_time(), last_teams_id);
 				
-				teams_post_or_get(sa, TEAMS_METHOD_PUT | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
+				teams_post_or_get(sa, TEAMS_METHOD_PUT | TEAMS_METHOD_SSL | TEAMS_METHOD_INTERACTIVE, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
 				
 				g_free(convname);
 				g_free(post);
@@ -1511,34 +1696,28 @@ teams_get_conversation_history(TeamsAccount *sa, const gchar *convname)
 }
 
 static void
-teams_got_all_convs(TeamsAccount *sa, JsonNode *node, gpointer user_data)
+teams_got_conv(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 {
 	gint since = GPOINTER_TO_INT(user_data);
-	JsonObject *obj;
-	JsonArray *conversations;
-	gint index, length;
+	JsonObject *conversation;
+	JsonObject *lastMessage;
+	const gchar *id;
 	
-	if (node == NULL || json_node_get_node_type(node) != JSON_NODE_OBJECT)
+	if (json_node_get_node_type(node) != JSON_NODE_OBJECT)
 		return;
-	obj = json_node_get_object(node);
+	conversation = json_node_get_object(node);
+	id = json_object_get_string_member(conversation, "id");
+	lastMessage = json_object_get_object_member(conversation, "lastMessage");
 	
-	conversations = json_object_get_array_member(obj, "conversations");
-	length = json_array_get_length(conversations);
-	for(index = 0; index < length; index++) {
-		JsonObject *conversation = json_array_get_object_element(conversations, index);
-		const gchar *id = json_object_get_string_member(conversation, "id");
-		JsonObject *lastMessage = json_object_get_object_member(conversation, "lastMessage");
+	if (lastMessage != NULL && json_object_has_member(lastMessage, "composetime")) {
+		const gchar *composetime = json_object_get_string_member(lastMessage, "composetime");
+		gint composetimestamp = (gint) purple_str_to_time(composetime, TRUE, NULL, NULL, NULL);
 		
-		if (lastMessage != NULL && json_object_has_member(lastMessage, "composetime")) {
-			const gchar *composetime = json_object_get_string_member(lastMessage, "composetime");
-			gint composetimestamp = (gint) purple_str_to_time(composetime, TRUE, NULL, NULL, NULL);
-			
-			// Check if it's a one-to-one before we fetch history
-			process_conversation_resource(sa, conversation);
-			
-			if (composetimestamp > since) {
-				teams_get_conversation_history_since(sa, id, since);
-			}
+		// Check if it's a one-to-one before we fetch history
+		process_conversation_resource(sa, conversation);
+		
+		if (composetimestamp > since) {
+			teams_get_conversation_history_since(sa, id, since);
 		}
 	}
 }
@@ -1549,7 +1728,8 @@ teams_get_all_conversations_since(TeamsAccount *sa, gint since)
 	gchar *url;
 	url = g_strdup_printf("/v1/users/ME/conversations?startTime=%d000&pageSize=100&view=msnp24Equivalent&targetType=Passport|Skype|Lync|Thread|PSTN|Agent", since);
 	
-	teams_post_or_get(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, NULL, teams_got_all_convs, GINT_TO_POINTER(since), TRUE);
+	// Busy accounts can have more than fits in a buffered response, so take it a conversation at a time
+	teams_post_or_get_stream(sa, TEAMS_METHOD_GET | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, NULL, "conversations", teams_got_conv, NULL, GINT_TO_POINTER(since), TRUE);
 	
 	g_free(url);
 }
@@ -1862,6 +2042,9 @@ teams_subscribe_cb(TeamsAccount *sa, JsonNode *node, gpointer user_data)
 			gchar *next_server = teams_string_get_chunk(longpollurl, -1, "https://", "/users");
 			
 			if (next_server != NULL) {
+				if (!purple_strequal(sa->messages_host, next_server)) {
+					teams_host_profiles_invalidate(sa);
+				}
 				g_free(sa->messages_host);
 				sa->messages_host = next_server;
 			}
@@ -1914,6 +2097,7 @@ teams_subscribe_with_callback(TeamsAccount *sa, TeamsProxyCallbackFunc callback)
 
 	if (!sa->endpoint) {
 		sa->endpoint = purple_uuid_random();
+		teams_host_profiles_invalidate(sa);
 	}
 
 	gchar *url = g_strdup_printf("/v2/users/ME/endpoints/%s", purple_url_encode(sa->endpoint));
@@ -1991,7 +2175,7 @@ teams_conv_send_typing_to_channel(TeamsAccount *sa, const gchar *channel, Purple
 	
 	post = teams_jsonobj_to_string(obj);
 	
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_INTERACTIVE, TEAMS_CONTACTS_HOST, url, post, NULL, NULL, TRUE);
 	
 	g_free(post);
 	json_object_unref(obj);
@@ -2211,7 +2395,7 @@ teams_send_message(TeamsAccount *sa, const gchar *convname, const gchar *message
 	
 	post = teams_jsonobj_to_string(obj);
 	
-	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, url, post, teams_sent_message_cb, g_strdup(convname), TRUE);
+	teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_INTERACTIVE, TEAMS_CONTACTS_HOST, url, post, teams_sent_message_cb, g_strdup(convname), TRUE);
 	
 	g_free(post);
 	json_object_unref(obj);
@@ -2420,12 +2604,11 @@ teams_initiate_chat(TeamsAccount *sa, const gchar *who, gboolean one_to_one, con
 		initial_message_copy = NULL;
 	}
 	
-	conn = teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL, TEAMS_CONTACTS_HOST, "/v1/threads", post, teams_created_chat, initial_message_copy, TRUE);
+	conn = teams_post_or_get(sa, TEAMS_METHOD_POST | TEAMS_METHOD_SSL | TEAMS_METHOD_INTERACTIVE, TEAMS_CONTACTS_HOST, "/v1/threads", post, teams_created_chat, initial_message_copy, TRUE);
 	
 	// Enable redirects
-	if (conn != NULL) {
-		PurpleHttpRequest *request = purple_http_conn_get_request(conn->http_conn);
-		purple_http_request_set_max_redirects(request, 1);
+	if (conn != NULL && conn->request != NULL) {
+		purple_http_request_set_max_redirects(conn->request, 1);
 	}
 
 	g_free(post);
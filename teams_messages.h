@@ -45,7 +45,11 @@ void teams_set_status(PurpleAccount *account, PurpleStatus *status);
 guint teams_conv_send_typing(PurpleConversation *conv, PurpleIMTypingState state);
 guint teams_send_typing(PurpleConnection *pc, const gchar *name, PurpleIMTypingState state);
 void teams_process_event_message(TeamsAccount *sa, JsonObject *message);
+void teams_event_index_init(TeamsAccount *sa);
+void teams_event_index_destroy(TeamsAccount *sa);
+gboolean teams_event_index_seen(TeamsAccount *sa, JsonObject *message);
 void teams_poll(TeamsAccount *sa);
+void teams_poll_wake(TeamsAccount *sa);
 void teams_get_registration_token(TeamsAccount *sa);
 void teams_subscribe(TeamsAccount *sa);
 void teams_subscribe_with_callback(TeamsAccount *sa, TeamsProxyCallbackFunc callback);
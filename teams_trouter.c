@@ -22,6 +22,122 @@
 #include "teams_messages.h"
 #include "teams_util.h"
 
+#include <zlib.h>
+
+// Upper bound on presizing from the gzip ISIZE trailer
+#define TEAMS_TROUTER_PRESIZE_MAX (16 * 1024 * 1024)
+
+// Scratch state for unpacking trouter payloads, reused between frames
+typedef struct _TeamsTrouterDecoder {
+	z_stream zstr;
+	gboolean zstr_ready;
+	guchar *in;
+	gsize in_size;
+	gchar *out;
+	gsize out_size;
+} TeamsTrouterDecoder;
+
+static void
+teams_trouter_decoder_free(TeamsTrouterDecoder *dec)
+{
+	if (dec == NULL) {
+		return;
+	}
+	if (dec->zstr_ready) {
+		inflateEnd(&dec->zstr);
+	}
+	g_free(dec->in);
+	g_free(dec->out);
+	g_free(dec);
+}
+
+static const guchar *
+teams_trouter_base64_decode(TeamsTrouterDecoder *dec, const gchar *text, gsize *out_len)
+{
+	gsize text_len = text ? strlen(text) : 0;
+	gsize needed = (text_len / 4) * 3 + 3;
+	gint state = 0;
+	guint save = 0;
+	
+	if (needed > dec->in_size) {
+		dec->in = g_realloc(dec->in, needed);
+		dec->in_size = needed;
+	}
+	
+	*out_len = g_base64_decode_step(text, text_len, dec->in, &state, &save);
+	return dec->in;
+}
+
+static const gchar *
+teams_trouter_gunzip(TeamsTrouterDecoder *dec, const guchar *data, gsize len, gsize *out_len)
+{
+	gsize expected = 0;
+	gsize used;
+	gboolean raw = FALSE;
+	int err;
+	
+	if (!dec->zstr_ready) {
+		memset(&dec->zstr, 0, sizeof(z_stream));
+		if (inflateInit2(&dec->zstr, MAX_WBITS + 32) != Z_OK) {
+			purple_debug_error("teams", "no built-in gzip support in zlib\n");
+			return NULL;
+		}
+		dec->zstr_ready = TRUE;
+	} else {
+		inflateReset2(&dec->zstr, MAX_WBITS + 32);
+	}
+	
+	// gzip stores the uncompressed size (mod 2^32) in the last four bytes
+	if (len >= 18 && data[0] == 0x1f && data[1] == 0x8b) {
+		expected = data[len - 4] | (data[len - 3] << 8) | (data[len - 2] << 16) | ((gsize) data[len - 1] << 24);
+		// it comes off the wire, so only trust it so far; the loop below grows the buffer if needed
+		expected = MIN(expected, MIN(len * 64, TEAMS_TROUTER_PRESIZE_MAX));
+	}
+	if (expected + 1 > dec->out_size) {
+		dec->out_size = MAX(expected + 1, 4096);
+		dec->out = g_realloc(dec->out, dec->out_size);
+	}
+	
+	dec->zstr.next_in = (Bytef *) data;
+	dec->zstr.avail_in = len;
+	dec->zstr.next_out = (Bytef *) dec->out;
+	dec->zstr.avail_out = dec->out_size - 1;
+	
+	for (;;) {
+		err = inflate(&dec->zstr, Z_SYNC_FLUSH);
+		
+		if (err == Z_STREAM_END) {
+			break;
+		}
+		if (err == Z_DATA_ERROR && !raw && dec->zstr.total_out == 0) {
+			// No gzip or zlib header, try it as raw deflate
+			raw = TRUE;
+			inflateReset2(&dec->zstr, -MAX_WBITS);
+			dec->zstr.next_in = (Bytef *) data;
+			dec->zstr.avail_in = len;
+			continue;
+		}
+		if ((err == Z_OK || err == Z_BUF_ERROR) && dec->zstr.avail_out == 0) {
+			// ISIZE lied or wasn't there, make room and keep going
+			used = (gchar *) dec->zstr.next_out - dec->out;
+			dec->out_size *= 2;
+			dec->out = g_realloc(dec->out, dec->out_size);
+			dec->zstr.next_out = (Bytef *) dec->out + used;
+			dec->zstr.avail_out = dec->out_size - 1 - used;
+			continue;
+		}
+		
+		purple_debug_error("teams", "gzip inflate error\n");
+		break;
+	}
+	
+	used = (gchar *) dec->zstr.next_out - dec->out;
+	dec->out[used] = '\0';
+	*out_len = used;
+	
+	return dec->out;
+}
+
 void
 teams_trouter_stop(TeamsAccount *sa)
 {
@@ -37,7 +153,100 @@ teams_trouter_stop(TeamsAccount *sa)
 		g_free(sa->trouter_surl);
 		sa->trouter_surl = NULL;
 	}
+	if (sa->trouter_reconnect_timeout) {
+		purple_timeout_remove(sa->trouter_reconnect_timeout);
+		sa->trouter_reconnect_timeout = 0;
+	}
+
+}
+
+static void
+teams_trouter_forget(TeamsAccount *sa)
+{
+	if (sa->trouter_info) {
+		json_object_unref(sa->trouter_info);
+		sa->trouter_info = NULL;
+	}
+	sa->trouter_info_expiry = 0;
+}
+
+void
+teams_trouter_free(TeamsAccount *sa)
+{
+	teams_trouter_stop(sa);
+	teams_trouter_forget(sa);
+	
+	teams_trouter_decoder_free(sa->trouter_decoder);
+	sa->trouter_decoder = NULL;
+	
+	g_free(sa->trouter_registered_surl);
+	sa->trouter_registered_surl = NULL;
+	g_free(sa->trouter_registering_surl);
+	sa->trouter_registering_surl = NULL;
+	g_slist_free_full(sa->trouter_registrations, (GDestroyNotify) purple_http_request_unref);
+	sa->trouter_registrations = NULL;
+}
+
+static gint64
+teams_trouter_info_expiry(JsonObject *obj)
+{
+	JsonObject *connectparams = json_object_get_object_member(obj, "connectparams");
+	const gchar *se = json_object_get_string_member(connectparams, "se");
+	gint64 expiry = se ? g_ascii_strtoll(se, NULL, 10) : 0;
+	
+	if (expiry > G_GINT64_CONSTANT(100000000000)) {
+		// milliseconds
+		expiry /= 1000;
+	}
+	if (expiry <= 0) {
+		// No idea, assume an hour
+		expiry = time(NULL) + 3600;
+	}
+	
+	return expiry;
+}
+
+static gboolean
+teams_trouter_reconnect_cb(gpointer user_data)
+{
+	TeamsAccount *sa = user_data;
+	
+	sa->trouter_reconnect_timeout = 0;
+	teams_trouter_begin(sa);
+	
+	return FALSE;
+}
+
+static void
+teams_trouter_schedule_reconnect(TeamsAccount *sa)
+{
+	guint delay;
+	
+	if (sa->trouter_reconnect_timeout) {
+		return;
+	}
+	
+	delay = MIN(1 << MIN(sa->trouter_reconnect_attempts, 9), TEAMS_TROUTER_MAX_BACKOFF_SECONDS);
+	// Jitter so we don't hammer the server in lockstep with everyone else after an outage
+	delay = MAX(delay / 2 + g_random_int_range(0, delay / 2 + 1), 1);
+	sa->trouter_reconnect_attempts++;
+	
+	// The websocket doesn't tell us why it failed, so if the cached params
+	// keep failing assume they're no good any more
+	if (sa->trouter_reconnect_attempts > 3) {
+		teams_trouter_forget(sa);
+	}
+	
+	purple_debug_info("teams", "Trouter: reconnecting in %u seconds\n", delay);
+	sa->trouter_reconnect_timeout = purple_timeout_add_seconds(delay, teams_trouter_reconnect_cb, sa);
+}
 
+gboolean
+teams_trouter_is_healthy(TeamsAccount *sa)
+{
+	// We ping every 30 seconds, so something should have come back since
+	return sa->trouter_socket != NULL &&
+		time(NULL) - sa->trouter_last_activity < TEAMS_TROUTER_HEALTHY_SECONDS;
 }
 
 void
@@ -61,8 +270,10 @@ teams_trouter_websocket_cb(PurpleWebsocket *ws, gpointer user_data, PurpleWebsoc
 	TeamsAccount *sa = user_data;
 
 	purple_debug_info("teams", "Trouter WS: %d %.*s\n", op, (int) len, msg);
+	sa->trouter_last_activity = time(NULL);
 	if (op == PURPLE_WEBSOCKET_OPEN) {
 		purple_debug_info("teams", "Trouter WS: Opened\n");
+		sa->trouter_reconnect_attempts = 0;
 
 		teams_trouter_send_active(sa, TRUE);
 
@@ -72,14 +283,16 @@ teams_trouter_websocket_cb(PurpleWebsocket *ws, gpointer user_data, PurpleWebsoc
 		// _CLOSE calls abort internally, bypass to prevent double-free
 		sa->trouter_socket = NULL;
 		teams_trouter_stop(sa);
-		//TODO reopen?
+		teams_poll_wake(sa);
+		teams_trouter_schedule_reconnect(sa);
 		return;
 	} else if (op == PURPLE_WEBSOCKET_ERROR) {
 		purple_debug_info("teams", "Trouter WS: Error\n");
 		// _ERROR calls abort internally, bypass to prevent double-free
 		sa->trouter_socket = NULL;
 		teams_trouter_stop(sa);
-		//TODO reopen?
+		teams_poll_wake(sa);
+		teams_trouter_schedule_reconnect(sa);
 		return;
 	} else if (op == PURPLE_WEBSOCKET_PING) {
 		purple_debug_info("teams", "Trouter WS: Ping\n");
@@ -127,35 +340,46 @@ teams_trouter_websocket_cb(PurpleWebsocket *ws, gpointer user_data, PurpleWebsoc
 			g_free(response_str);
 
 			JsonObject *headers = json_object_get_object_member(request, "headers");
-			gchar *body = g_strdup(json_object_get_string_member(request, "body"));
-			if (purple_strequal(json_object_get_string_member(headers, "X-Microsoft-Skype-Content-Encoding"), "gzip")) {
-				gsize body_len;
-				guchar *body_base64_decoded = g_base64_decode(body, &body_len);
-				gchar *body_unzipped = teams_gunzip(body_base64_decoded, &body_len);
-				g_free(body_base64_decoded);
-				g_free(body);
-				body = body_unzipped;
+			const gchar *body = json_object_get_string_member(request, "body");
+			gsize body_len = body ? strlen(body) : 0;
+			TeamsTrouterDecoder *dec = sa->trouter_decoder;
+			
+			if (dec == NULL) {
+				dec = sa->trouter_decoder = g_new0(TeamsTrouterDecoder, 1);
+			}
+			
+			// Decoded data lives in the decoder's buffers until the next decode,
+			// so each stage is parsed before the next one is unpacked
+			if (body != NULL && purple_strequal(json_object_get_string_member(headers, "X-Microsoft-Skype-Content-Encoding"), "gzip")) {
+				const guchar *zipped = teams_trouter_base64_decode(dec, body, &body_len);
+				body = teams_trouter_gunzip(dec, zipped, body_len, &body_len);
+			}
+			
+			JsonObject *body_obj = body ? json_decode_object(body, body_len) : NULL;
+			if (body_obj == NULL) {
+				purple_debug_warning("teams", "Trouter WS: Couldn't decode request body\n");
+				json_object_unref(request);
+				return;
 			}
-
-			JsonObject *body_obj = json_decode_object(body, strlen(body));
 			JsonObject *orig_body = json_object_ref(body_obj);
 			
 			if (json_object_has_member(body_obj, "cp")) {
 				const gchar *cp = json_object_get_string_member(body_obj, "cp");
 				gsize cp_len;
-				guchar *cp_base64_decoded = g_base64_decode(cp, &cp_len);
-				gchar *cp_unzipped = teams_gunzip(cp_base64_decoded, &cp_len);
+				const guchar *cp_zipped = teams_trouter_base64_decode(dec, cp, &cp_len);
+				const gchar *cp_unzipped = teams_trouter_gunzip(dec, cp_zipped, cp_len, &cp_len);
 				json_object_unref(body_obj);
-				body_obj = json_decode_object(cp_unzipped, cp_len);
-				g_free(cp_unzipped);
-				g_free(cp_base64_decoded);
+				body_obj = cp_unzipped ? json_decode_object(cp_unzipped, cp_len) : NULL;
 			} else if (json_object_has_member(body_obj, "gp")) {
 				const gchar *gp = json_object_get_string_member(body_obj, "gp");
 				gsize gp_len;
-				guchar *gp_base64_decoded = g_base64_decode(gp, &gp_len);
+				const guchar *gp_decoded = teams_trouter_base64_decode(dec, gp, &gp_len);
 				json_object_unref(body_obj);
-				body_obj = json_decode_object((gchar *) gp_base64_decoded, gp_len);
-				g_free(gp_base64_decoded);
+				body_obj = json_decode_object((const gchar *) gp_decoded, gp_len);
+			}
+			if (body_obj == NULL) {
+				// Keep the handlers below from tripping over a bad payload
+				body_obj = json_object_new();
 			}
 
 			const gchar *request_url = json_object_get_string_member(request, "url");
@@ -175,7 +399,7 @@ teams_trouter_websocket_cb(PurpleWebsocket *ws, gpointer user_data, PurpleWebsoc
 			} else if (g_str_has_suffix(request_url, "/messaging")) {
 				const gchar *type = json_object_get_string_member(body_obj, "type");
 
-				if (purple_strequal(type, "EventMessage")) {
+				if (purple_strequal(type, "EventMessage") && !teams_event_index_seen(sa, body_obj)) {
 					teams_process_event_message(sa, body_obj);
 				}
 
@@ -300,7 +524,6 @@ teams_trouter_websocket_cb(PurpleWebsocket *ws, gpointer user_data, PurpleWebsoc
 			json_object_unref(orig_body);
 			json_object_unref(body_obj);
 			json_object_unref(request);
-			g_free(body);
 		}
 	}
 }
@@ -333,67 +556,58 @@ teams_trouter_send_ping(gpointer user_data)
 }
 
 static void
-teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
+teams_trouter_registrations_free(TeamsAccount *sa)
 {
-	// node is plaintext
-	// abcdef123487698-abcdef123487698:180:180:websocket,xhr-polling
-	// grab bit before first colon and use as trouter websocket session
+	g_slist_free_full(sa->trouter_registrations, (GDestroyNotify) purple_http_request_unref);
+	sa->trouter_registrations = NULL;
+}
 
-	PurpleConnection *pc = purple_http_conn_get_purple_connection(http_conn);
-	TeamsAccount *sa = purple_connection_get_protocol_data(pc);
-	JsonObject *obj = user_data;
-	JsonObject *connectparams;
-	const gchar *data;
-	gsize len;
-	GList *iter, *list;
+static void
+teams_trouter_register_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
+{
+	TeamsAccount *sa = user_data;
+	GSList *link = g_slist_find(sa->trouter_registrations, purple_http_conn_get_request(http_conn));
 	
-	data = purple_http_response_get_data(response, &len);
-
-	gchar **node_parts = g_strsplit(data, ":", 2);
-	const gchar *session_id = node_parts[0];
-
-	if (sa->trouter_socket) {
-		purple_websocket_abort(sa->trouter_socket);
+	if (link == NULL) {
+		// from an earlier round, or one that already failed
+		return;
 	}
-
-	GString *url = g_string_new("");
-
-	const gchar *socketio = json_object_get_string_member(obj, "socketio");
-	if (socketio == NULL) {
-#ifdef ENABLE_TEAMS_PERSONAL
-		socketio = "https://go.trouter.skype.com/";
-#else
-		socketio = "https://go.trouter.teams.microsoft.com/";
-#endif
+	
+	if (!purple_http_response_is_successful(response)) {
+		purple_debug_error("teams", "Trouter registration failed: %d\n", purple_http_response_get_code(response));
+		// forget the round, so the next reconnect registers again
+		teams_trouter_registrations_free(sa);
+		g_free(sa->trouter_registering_surl);
+		sa->trouter_registering_surl = NULL;
+		return;
 	}
-	g_string_append_printf(url, "%ssocket.io/1/websocket/%s?v=v4&", socketio, session_id);
+	
+	purple_http_request_unref(link->data);
+	sa->trouter_registrations = g_slist_delete_link(sa->trouter_registrations, link);
+	if (sa->trouter_registrations == NULL) {
+		g_free(sa->trouter_registered_surl);
+		sa->trouter_registered_surl = sa->trouter_registering_surl;
+		sa->trouter_registering_surl = NULL;
+		sa->trouter_registered_at = time(NULL);
+	}
+}
 
-	connectparams = json_object_get_object_member(obj, "connectparams");
-	list = json_object_get_members(connectparams);
-	for (iter = list; iter; iter = iter->next) {
-		const gchar *key = iter->data;
-		const gchar *value = json_object_get_string_member(connectparams, key);
-		g_string_append_printf(url, "%s=%s&", key, purple_url_encode(value));
+static gboolean
+teams_trouter_needs_register(TeamsAccount *sa)
+{
+	if (sa->trouter_registrations != NULL && purple_strequal(sa->trouter_registering_surl, sa->trouter_surl)) {
+		// already on its way
+		return FALSE;
 	}
-	g_list_free(list);
-	g_string_append_printf(url, "tc=%s&", purple_url_encode("{\"cv\":\"2023.45.01.11\",\"ua\":\"TeamsCDL\",\"hr\":\"\",\"v\":\"49/23111630013\"}"));
-	g_string_append_printf(url, "con_num=%" G_GINT64_FORMAT "_%d&", 1234567890123, 1); //TODO sa->trouter_count++
-	const gchar *ccid = json_object_get_string_member(obj, "ccid");
-	if (ccid != NULL) {
-		g_string_append_printf(url, "ccid=%s&", purple_url_encode(ccid));
+	if (!purple_strequal(sa->trouter_registered_surl, sa->trouter_surl)) {
+		return TRUE;
 	}
-	g_string_append(url, "auth=true&timeout=40&");
-
-	sa->trouter_ping_timeout = purple_timeout_add_seconds(30, teams_trouter_send_ping, sa);
-	sa->trouter_command_count = 1;
-
-	purple_debug_info("teams", "Trouter WS URL: %s\n", url->str);
-	
-	// Inject the extra header (hack!)
-	gchar *skypetoken_header = g_strdup_printf("\r\nX-Skypetoken: %s", sa->skype_token);
-	sa->trouter_socket = purple_websocket_connect(sa->account, url->str, skypetoken_header, teams_trouter_websocket_cb, sa);
-	g_free(skypetoken_header);
+	return time(NULL) - sa->trouter_registered_at > TEAMS_TROUTER_REGISTRATION_TTL - TEAMS_TROUTER_REREGISTER_MARGIN;
+}
 
+static void
+teams_trouter_register(TeamsAccount *sa)
+{
 	// Register the trouter path at 
 	// https://teams.microsoft.com/registrar/prod/V2/registrations
 	// with postbody
@@ -421,10 +635,10 @@ teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *
 	// NextGenCalling for call messages
 	// SkypeSpacesWeb has additional call info
 
-	if (sa->trouter_surl) {
-		g_free(sa->trouter_surl);
-	}
-	sa->trouter_surl = g_strdup(json_object_get_string_member(obj, "surl"));
+	// Start a new round; replies to an older one are ignored
+	teams_trouter_registrations_free(sa);
+	g_free(sa->trouter_registering_surl);
+	sa->trouter_registering_surl = g_strdup(sa->trouter_surl);
 	
 	//TODO scan through buddy list and call teams_subscribe_to_contact_status instead
 	teams_get_friend_list(sa);
@@ -445,7 +659,7 @@ teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *
 
 	json_object_set_string_member(trouter_obj, "context", "");
 	json_object_set_string_member(trouter_obj, "path", sa->trouter_surl);
-	json_object_set_int_member(trouter_obj, "ttl", 86400);
+	json_object_set_int_member(trouter_obj, "ttl", TEAMS_TROUTER_REGISTRATION_TTL);
 
 	json_array_add_object_element(trouter, trouter_obj);
 	json_object_set_array_member(transports, "TROUTER", trouter);
@@ -470,8 +684,9 @@ teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *
 	purple_http_request_header_set(request, "Content-Type", "application/json");
 	purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
 	purple_http_request_set_contents(request, reg_str, strlen(reg_str));
-	purple_http_request(sa->pc, request, NULL, NULL);
-	purple_http_request_unref(request);
+	// the round keeps the reference, replies are matched by request
+	sa->trouter_registrations = g_slist_prepend(sa->trouter_registrations, request);
+	purple_http_request(sa->pc, request, teams_trouter_register_cb, sa);
 
 	g_free(reg_str);
 
@@ -491,8 +706,8 @@ teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *
 	purple_http_request_header_set(request, "Content-Type", "application/json");
 	purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
 	purple_http_request_set_contents(request, reg_str, strlen(reg_str));
-	purple_http_request(sa->pc, request, NULL, NULL);
-	purple_http_request_unref(request);
+	sa->trouter_registrations = g_slist_prepend(sa->trouter_registrations, request);
+	purple_http_request(sa->pc, request, teams_trouter_register_cb, sa);
 
 	g_free(reg_str);
 
@@ -512,31 +727,137 @@ teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *
 	purple_http_request_header_set(request, "Content-Type", "application/json");
 	purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
 	purple_http_request_set_contents(request, reg_str, strlen(reg_str));
-	purple_http_request(sa->pc, request, NULL, NULL);
-	purple_http_request_unref(request);
+	sa->trouter_registrations = g_slist_prepend(sa->trouter_registrations, request);
+	purple_http_request(sa->pc, request, teams_trouter_register_cb, sa);
 
 	g_free(reg_str);
 	json_object_unref(reg_obj);
-	json_object_unref(obj);
+}
+
+static void
+teams_trouter_sessionid_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
+{
+	// node is plaintext
+	// abcdef123487698-abcdef123487698:180:180:websocket,xhr-polling
+	// grab bit before first colon and use as trouter websocket session
+
+	TeamsAccount *sa = user_data;
+	JsonObject *obj = sa->trouter_info;
+	JsonObject *connectparams;
+	const gchar *data;
+	gsize len;
+	GList *iter, *list;
+	
+	data = purple_http_response_get_data(response, &len);
+	
+	if (!purple_http_response_is_successful(response) || data == NULL || obj == NULL) {
+		gint code = purple_http_response_get_code(response);
+		
+		purple_debug_error("teams", "Trouter session request failed: %d\n", code);
+		if (code == 401 || code == 403) {
+			// Connect params were rejected, rediscover next time
+			teams_trouter_forget(sa);
+		}
+		teams_trouter_schedule_reconnect(sa);
+		return;
+	}
+
+	gchar **node_parts = g_strsplit(data, ":", 2);
+	const gchar *session_id = node_parts[0];
+
+	if (sa->trouter_socket) {
+		purple_websocket_abort(sa->trouter_socket);
+	}
+
+	GString *url = g_string_new("");
+
+	const gchar *socketio = json_object_get_string_member(obj, "socketio");
+	if (socketio == NULL) {
+#ifdef ENABLE_TEAMS_PERSONAL
+		socketio = "https://go.trouter.skype.com/";
+#else
+		socketio = "https://go.trouter.teams.microsoft.com/";
+#endif
+	}
+	g_string_append_printf(url, "%ssocket.io/1/websocket/%s?v=v4&", socketio, session_id);
+
+	connectparams = json_object_get_object_member(obj, "connectparams");
+	list = json_object_get_members(connectparams);
+	for (iter = list; iter; iter = iter->next) {
+		const gchar *key = iter->data;
+		const gchar *value = json_object_get_string_member(connectparams, key);
+		g_string_append_printf(url, "%s=%s&", key, purple_url_encode(value));
+	}
+	g_list_free(list);
+	g_string_append_printf(url, "tc=%s&", purple_url_encode("{\"cv\":\"2023.45.01.11\",\"ua\":\"TeamsCDL\",\"hr\":\"\",\"v\":\"49/23111630013\"}"));
+	g_string_append_printf(url, "con_num=%" G_GINT64_FORMAT "_%d&", 1234567890123, 1); //TODO sa->trouter_count++
+	const gchar *ccid = json_object_get_string_member(obj, "ccid");
+	if (ccid != NULL) {
+		g_string_append_printf(url, "ccid=%s&", purple_url_encode(ccid));
+	}
+	g_string_append(url, "auth=true&timeout=40&");
+
+	sa->trouter_ping_timeout = purple_timeout_add_seconds(30, teams_trouter_send_ping, sa);
+	sa->trouter_command_count = 1;
+
+	purple_debug_info("teams", "Trouter WS URL: %s\n", url->str);
+	
+	// Inject the extra header (hack!)
+	gchar *skypetoken_header = g_strdup_printf("\r\nX-Skypetoken: %s", sa->skype_token);
+	sa->trouter_socket = purple_websocket_connect(sa->account, url->str, skypetoken_header, teams_trouter_websocket_cb, sa);
+	g_free(skypetoken_header);
+
+	if (sa->trouter_surl) {
+		g_free(sa->trouter_surl);
+	}
+	sa->trouter_surl = g_strdup(json_object_get_string_member(obj, "surl"));
+	
+	// Registrations live for a day, only redo them if trouter moved us or they're about to lapse
+	if (teams_trouter_needs_register(sa)) {
+		teams_trouter_register(sa);
+	}
+
 	g_strfreev(node_parts);
 	g_string_free(url, TRUE);
 }
 
+static void teams_trouter_connect(TeamsAccount *sa);
+
 static void
 teams_trouter_info_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
 	TeamsAccount *sa = user_data;
 	JsonObject *obj = NULL;
-	GString *url = g_string_new("");
 	const gchar *data;
 	gsize len;
+	
+	data = purple_http_response_get_data(response, &len);
+	if (purple_http_response_is_successful(response)) {
+		obj = json_decode_object(data, len);
+	}
+	
+	if (obj == NULL) {
+		purple_debug_error("teams", "Trouter discovery failed: %d\n", purple_http_response_get_code(response));
+		teams_trouter_schedule_reconnect(sa);
+		return;
+	}
+	
+	teams_trouter_forget(sa);
+	sa->trouter_info = obj;
+	sa->trouter_info_expiry = teams_trouter_info_expiry(obj);
+	
+	teams_trouter_connect(sa);
+}
+
+static void
+teams_trouter_connect(TeamsAccount *sa)
+{
+	JsonObject *obj = sa->trouter_info;
+	GString *url = g_string_new("");
 	PurpleHttpRequest *request;
 	JsonObject *connectparams;
 	GList *iter, *list;
 	
-	data = purple_http_response_get_data(response, &len);
-	obj = json_decode_object(data, len);
-	
 	// node is {
 	// 	"socketio": "https://trouter2-abcd-abcd-1-a.trouter.teams.microsoft.com:443/",
 	//  "surl": "https://trouter2-abcd-abcd-1-a.trouter.teams.microsoft.com:3443/v4/f/blahblahblah/",
@@ -577,11 +898,10 @@ teams_trouter_info_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *respo
 	purple_http_request_set_method(request, "GET");
 	purple_http_request_set_keepalive_pool(request, sa->keepalive_pool);
 	purple_http_request_header_set(request, "X-Skypetoken", sa->skype_token);
-	purple_http_request(sa->pc, request, teams_trouter_sessionid_cb, obj);
+	purple_http_request(sa->pc, request, teams_trouter_sessionid_cb, sa);
 	purple_http_request_unref(request);
 	
 	g_string_free(url, TRUE);
-	// Do not unref obj, passed to callback
 }
 
 void
@@ -591,9 +911,14 @@ teams_trouter_begin(TeamsAccount *sa)
 	GString *url = g_string_new("https://go.trouter.teams.microsoft.com/v4/a?");
 	PurpleHttpRequest *request;
 
-	//TODO we can bypass this if we already have the obj response from the previous connectparams
-
 	teams_trouter_stop(sa);
+	
+	// Skip discovery while the previous connectparams are still good
+	if (sa->trouter_info != NULL && time(NULL) + 60 < sa->trouter_info_expiry) {
+		teams_trouter_connect(sa);
+		g_string_free(url, TRUE);
+		return;
+	}
 
 	// Doesn't seem to be needed
 	// g_string_append_printf(url, "cor_id=%s&", purple_url_encode(sa->session_id));
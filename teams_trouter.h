@@ -24,7 +24,9 @@
 
 void teams_trouter_begin(TeamsAccount *sa);
 void teams_trouter_stop(TeamsAccount *sa);
+void teams_trouter_free(TeamsAccount *sa);
 gboolean teams_trouter_send_message(TeamsAccount *sa, const gchar *message);
 void teams_trouter_send_active(TeamsAccount *sa, gboolean active);
+gboolean teams_trouter_is_healthy(TeamsAccount *sa);
 
 #endif /*TEAMS_TROUTER_H*/